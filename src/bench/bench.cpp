@@ -0,0 +1,416 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <unistd.h>
+
+#include "board.h"
+#include "table_file.h"
+#include "layer_store.h"
+#include "table_generator.h"
+#include "interface.h"
+
+#include "ankerl/unordered_dense.h"
+
+/**
+ * tables_bench [--filter text] [--threads n]
+ *
+ * times the hot kernels on fixed pseudo-random boards, then builds a few
+ * small tables end to end, and prints it all as JSON, one result a line,
+ * so two commits can be diffed. the checksums and position counts should
+ * never change unless the results do, only the timings should
+ */
+
+namespace {
+
+struct KernelResult {
+  std::string name;
+  uint64_t ops;
+  double ns_per_op;
+  uint64_t checksum;
+};
+
+struct GenerationResult {
+  std::string name;
+  int threads;
+  double seconds;
+  uint64_t positions;
+  std::array<float, 4> root;
+};
+
+// the layout the corpora get packed with, the same as the 8 space table
+const std::string STATIC_HASH = "a900b800c700d600";
+
+const double MIN_SECONDS = 0.2;
+
+// xorshift64, a fixed seed means every run times the same boards
+uint64_t next_random (uint64_t& state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+// ~40% empty squares and small tiles, roughly what a generator layer looks like
+std::vector<uint64_t> make_corpus (std::size_t size, uint64_t seed) {
+  std::vector<uint64_t> corpus;
+  corpus.reserve(size);
+
+  uint64_t state = seed;
+  for (std::size_t i = 0; i < size; i++) {
+    uint64_t board = 0;
+    for (int pos = 0; pos < 16; pos++) {
+      uint64_t r = next_random(state);
+      if (r % 10 < 4) {
+        continue;
+      }
+      board = Board::set_tile(board, pos % 4, pos / 4, 1 + (r >> 8) % 10);
+    }
+    corpus.push_back(board);
+  }
+
+  return corpus;
+}
+
+// runs f over the corpus until it's taken long enough to trust the time
+template <typename F>
+KernelResult time_kernel (const std::string& name, std::size_t ops_per_run, F f) {
+  uint64_t checksum = f(); // warm up, and the checksum is from one clean run
+  uint64_t runs = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  double seconds = 0;
+  uint64_t sink = 0;
+  do {
+    sink += f();
+    runs++;
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while (seconds < MIN_SECONDS);
+
+  // keeps the compiler from dropping the runs
+  if (sink == 42) {
+    std::cerr << "";
+  }
+
+  uint64_t ops = runs * ops_per_run;
+  return {name, ops, seconds * 1e9 / ops, checksum};
+}
+
+std::vector<KernelResult> run_kernels (Board& board_lut, TableGenerator& table_generator, uint64_t static_tiles, const std::string& filter) {
+  std::vector<KernelResult> results;
+  auto wanted = [&filter](const std::string& name) {
+    return name.find(filter) != std::string::npos;
+  };
+
+  const std::vector<uint64_t> corpus = make_corpus(1 << 16, 0x2048);
+  const uint64_t pack_mask = Board::make_pack_mask(static_tiles);
+
+  if (wanted("board.move")) {
+    results.push_back(time_kernel("board.move", corpus.size() * 4, [&] {
+      uint64_t sum = 0;
+      for (uint64_t board : corpus) {
+        sum += board_lut.move(board, Direction::up);
+        sum += board_lut.move(board, Direction::right);
+        sum += board_lut.move(board, Direction::down);
+        sum += board_lut.move(board, Direction::left);
+      }
+      return sum;
+    }));
+  }
+
+  if (wanted("board.get_empty_squares")) {
+    results.push_back(time_kernel("board.get_empty_squares", corpus.size(), [&] {
+      uint64_t sum = 0;
+      for (uint64_t board : corpus) {
+        sum += board_lut.get_empty_squares(board);
+      }
+      return sum;
+    }));
+  }
+
+  if (wanted("board.game_over")) {
+    results.push_back(time_kernel("board.game_over", corpus.size(), [&] {
+      uint64_t sum = 0;
+      for (uint64_t board : corpus) {
+        sum += board_lut.game_over(board);
+      }
+      return sum;
+    }));
+  }
+
+  if (wanted("board.pack_tiles")) {
+    results.push_back(time_kernel("board.pack_tiles", corpus.size(), [&] {
+      uint64_t sum = 0;
+      for (uint64_t board : corpus) {
+        sum += Board::pack_tiles(board, pack_mask);
+      }
+      return sum;
+    }));
+  }
+
+  if (wanted("board.unpack_tiles")) {
+    results.push_back(time_kernel("board.unpack_tiles", corpus.size(), [&] {
+      uint64_t sum = 0;
+      for (uint64_t board : corpus) {
+        sum += Board::unpack_tiles(board >> 32, pack_mask);
+      }
+      return sum;
+    }));
+  }
+
+  // what the generator's owner threads do with every board they're sent
+  if (wanted("dedup.insert")) {
+    results.push_back(time_kernel("dedup.insert", corpus.size() * 2, [&] {
+      ankerl::unordered_dense::set<uint64_t> set;
+      set.reserve(corpus.size());
+      uint64_t sum = 0;
+      for (int i = 0; i < 2; i++) {
+        for (uint64_t board : corpus) {
+          sum += set.insert(board).second;
+        }
+      }
+      return sum;
+    }));
+  }
+
+  // half the corpus is in the store, the way evaluating looks boards up
+  if (wanted("layer_store.find")) {
+    std::vector<LayerStore::Entry> entries;
+    for (std::size_t i = 0; i < corpus.size(); i += 2) {
+      uint64_t key = Board::pack_tiles(corpus[i], pack_mask);
+      entries.push_back({key, {static_cast<uint16_t>(key)}});
+    }
+    LayerStore store(entries, 8);
+
+    results.push_back(time_kernel("layer_store.find", corpus.size(), [&] {
+      float sum = 0;
+      for (uint64_t board : corpus) {
+        sum += store.find_best(Board::pack_tiles(board, pack_mask));
+      }
+      return static_cast<uint64_t>(sum);
+    }));
+  }
+
+  /**
+   * the same lookups in a store much bigger than the cache, like the GBs
+   * of lookahead a big table has, once one at a time and once in batches
+   * with prefetches the way evaluate_positions does them
+   */
+  if (wanted("layer_store.find_large") || wanted("layer_store.find_batched")) {
+    const int key_bits = 9 * 4;
+    std::vector<LayerStore::Entry> entries(1 << 24);
+    uint64_t state = 0x2048;
+    for (auto& entry : entries) {
+      entry.key = next_random(state) >> (64 - key_bits);
+      entry.best[0] = static_cast<uint16_t>(entry.key);
+    }
+
+    std::vector<uint64_t> lookups;
+    for (std::size_t i = 0; i < corpus.size(); i++) {
+      lookups.push_back(i % 2 == 0 ? entries[next_random(state) % entries.size()].key : next_random(state) >> (64 - key_bits));
+    }
+    LayerStore store(entries, key_bits / 4);
+    entries = std::vector<LayerStore::Entry>();
+
+    if (wanted("layer_store.find_large")) {
+      results.push_back(time_kernel("layer_store.find_large", lookups.size(), [&] {
+        float sum = 0;
+        for (uint64_t key : lookups) {
+          sum += store.find_best(key);
+        }
+        return static_cast<uint64_t>(sum);
+      }));
+    }
+
+    if (wanted("layer_store.find_batched")) {
+      const std::size_t BATCH = 64;
+      results.push_back(time_kernel("layer_store.find_batched", lookups.size(), [&] {
+        float sum = 0;
+        for (std::size_t begin = 0; begin < lookups.size(); begin += BATCH) {
+          std::size_t end = std::min(begin + BATCH, lookups.size());
+          for (std::size_t i = begin; i < end; i++) {
+            store.prefetch_bucket(lookups[i]);
+          }
+          for (std::size_t i = begin; i < end; i++) {
+            store.prefetch_keys(lookups[i]);
+          }
+          for (std::size_t i = begin; i < end; i++) {
+            sum += store.find_best(lookups[i]);
+          }
+        }
+        return static_cast<uint64_t>(sum);
+      }));
+    }
+  }
+
+  std::vector<std::array<float, 4>> probs;
+  uint64_t state = 0x4096;
+  for (std::size_t i = 0; i < corpus.size(); i++) {
+    std::array<float, 4> p;
+    for (float& prob : p) {
+      prob = (next_random(state) % 1000001) / 1e6f;
+    }
+    probs.push_back(p);
+  }
+
+  if (wanted("table_generator.pack_probs")) {
+    results.push_back(time_kernel("table_generator.pack_probs", probs.size(), [&] {
+      uint64_t sum = 0;
+      for (const auto& p : probs) {
+        sum += table_generator.pack_probs(p);
+      }
+      return sum;
+    }));
+  }
+
+  if (wanted("table_generator.unpack_probs")) {
+    results.push_back(time_kernel("table_generator.unpack_probs", corpus.size(), [&] {
+      float sum = 0;
+      for (uint64_t board : corpus) {
+        sum += table_generator.unpack_probs(board & 0xFFFFFFFFFFFFFF)[0];
+      }
+      return static_cast<uint64_t>(sum * 1000);
+    }));
+  }
+
+  return results;
+}
+
+struct GenerationConfig {
+  std::string name;
+  std::string start;
+  std::string static_tiles;
+  int goal;
+};
+
+// small enough to take seconds, hashes are the practice ones the interface takes
+const std::vector<GenerationConfig> GENERATION_CONFIGS = {
+  {"4-space", "a953b842c731d621", "a950b840c730d620", 32},
+  {"6-space", "a950b840c701d601", "a950b840c700d600", 64},
+  {"8-space", "a900b800c701d601", "a900b800c700d600", 64},
+};
+
+GenerationResult run_generation (Board& board_lut, const GenerationConfig& config, int num_threads) {
+  uint64_t start = Interface::hash_to_board(config.start, board_lut);
+  uint64_t static_tiles = Interface::hash_to_board(config.static_tiles, board_lut);
+  int goal_tile = __builtin_ctz(config.goal);
+
+  // reused positions would skip the part being measured
+  std::string table_dir = "table_bench_"s + config.name;
+  std::string positions_dir = TableGenerator::positions_dir_for(start, static_tiles, goal_tile);
+  std::filesystem::remove_all(table_dir);
+  std::filesystem::remove_all(positions_dir);
+
+  GenerationResult result;
+  result.name = config.name;
+  result.threads = num_threads;
+
+  // the generator reports every layer, which would get in the way of the JSON
+  std::ofstream null_stream("/dev/null");
+  std::streambuf* cout_buffer = std::cout.rdbuf(null_stream.rdbuf());
+
+  auto start_time = std::chrono::steady_clock::now();
+  {
+    TableGenerator table_generator(board_lut, table_dir, start, static_tiles, goal_tile, 1 << 16, num_threads);
+    table_generator.generate_table();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    result.root = table_generator.read_table(start).probs;
+  }
+
+  std::cout.rdbuf(cout_buffer);
+
+  result.positions = 0;
+  for (const auto& entry : std::filesystem::directory_iterator(table_dir)) {
+    // only the <sum>.txt files are tables, the rest is bookkeeping
+    std::string stem = entry.path().stem().string();
+    if (entry.path().extension() != ".txt" || stem.empty() || !std::all_of(stem.begin(), stem.end(), ::isdigit)) {
+      continue;
+    }
+    result.positions += TableFile(entry.path().string()).num_entries();
+  }
+
+  std::filesystem::remove_all(table_dir);
+  std::filesystem::remove_all(positions_dir);
+  return result;
+}
+
+std::string hex (uint64_t x) {
+  std::ostringstream out;
+  out << "\"0x" << std::hex << std::setw(16) << std::setfill('0') << x << "\"";
+  return out.str();
+}
+
+}
+
+int main (int argc, char* argv[]) {
+  std::string filter;
+  int num_threads = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (arg == "--threads" && i + 1 < argc) {
+      num_threads = std::max(1, std::atoi(argv[++i]));
+    } else {
+      std::cerr << "usage: tables_bench [--filter text] [--threads n]" << std::endl;
+      return 1;
+    }
+  }
+
+  // the generator writes positions/ and table dirs into the working directory
+  std::string work_dir = (std::filesystem::temp_directory_path() / "tables_bench_XXXXXX").string();
+  if (mkdtemp(work_dir.data()) == nullptr || chdir(work_dir.c_str()) != 0) {
+    std::cerr << "Could not make a work directory" << std::endl;
+    return 1;
+  }
+
+  Board board_lut;
+  uint64_t static_tiles = Interface::hash_to_board(STATIC_HASH, board_lut);
+  TableGenerator prob_packer(board_lut, "table_bench_probs", static_tiles, static_tiles, 7, 0, 1);
+
+  std::vector<KernelResult> kernels = run_kernels(board_lut, prob_packer, static_tiles, filter);
+
+  std::vector<GenerationResult> generations;
+  for (const auto& config : GENERATION_CONFIGS) {
+    if (("generate."s + config.name).find(filter) == std::string::npos) {
+      continue;
+    }
+    try {
+      generations.push_back(run_generation(board_lut, config, num_threads));
+    } catch (const std::runtime_error& ex) {
+      std::cerr << config.name << ": " << ex.what() << std::endl;
+    }
+  }
+
+  std::cout << std::fixed << "{" << std::endl << "  \"kernels\": [" << std::endl;
+  for (std::size_t i = 0; i < kernels.size(); i++) {
+    const auto& k = kernels[i];
+    std::cout
+      << "    {\"name\": \"" << k.name << "\", \"ops\": " << k.ops
+      << ", \"ns_per_op\": " << std::setprecision(3) << k.ns_per_op
+      << ", \"checksum\": " << hex(k.checksum) << "}"
+      << (i + 1 < kernels.size() ? "," : "") << std::endl;
+  }
+  std::cout << "  ]," << std::endl << "  \"generation\": [" << std::endl;
+  for (std::size_t i = 0; i < generations.size(); i++) {
+    const auto& g = generations[i];
+    std::cout
+      << "    {\"name\": \"generate." << g.name << "\", \"threads\": " << g.threads
+      << ", \"seconds\": " << std::setprecision(3) << g.seconds
+      << ", \"positions\": " << g.positions
+      << ", \"root\": [" << std::setprecision(6)
+      << g.root[0] << ", " << g.root[1] << ", " << g.root[2] << ", " << g.root[3] << "]}"
+      << (i + 1 < generations.size() ? "," : "") << std::endl;
+  }
+  std::cout << "  ]" << std::endl << "}" << std::endl;
+
+  std::filesystem::remove_all(work_dir);
+  return 0;
+}
@@ -0,0 +1,845 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cmath>
+#include <sstream>
+#include <functional>
+#include <unistd.h>
+
+#include "table_file.h"
+#include "position_file.h"
+#include "policy_file.h"
+#include "layer_store.h"
+#include "table_generator.h"
+#include "board.h"
+#include "lut.h"
+
+#include "ankerl/unordered_dense.h"
+
+/**
+ * tables_check, run by ctest
+ *
+ * writes every file format from random data, reads it back and compares,
+ * checks the board functions against the old ones, and makes a few small
+ * tables to check against a plain expectimax. one line a check, exits
+ * non zero if any of them failed. everything happens in a temporary
+ * directory that's removed afterwards
+ */
+
+namespace {
+
+int failures = 0;
+
+void check (bool ok, const std::string& what) {
+  std::cout << (ok ? "ok      " : "FAILED  ") << what << std::endl;
+  failures += !ok;
+}
+
+// xorshift64, a fixed seed so a failure happens again the next run
+uint64_t next_random (uint64_t& state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+// n unique random keys of key_bits bits, some in dense runs the way real layers have them
+std::vector<uint64_t> random_keys (uint64_t& state, std::size_t n, int key_bits) {
+  uint64_t mask = key_bits == 64 ? UINT64_MAX : (UINT64_C(1) << key_bits) - 1;
+  ankerl::unordered_dense::set<uint64_t> seen;
+  std::vector<uint64_t> keys;
+  while (keys.size() < n) {
+    uint64_t key = next_random(state) & mask;
+    int run = next_random(state) % 4 == 0 ? next_random(state) % 64 : 1;
+    for (int i = 0; i < run && keys.size() < n; i++, key = (key + 1) & mask) {
+      if (seen.insert(key).second) {
+        keys.push_back(key);
+      }
+    }
+  }
+  return keys;
+}
+
+// four directions of prob_bits, each one 0, all ones or anything, and sometimes the whole row 0 or 1
+uint64_t random_probs (uint64_t& state, int prob_bits) {
+  uint64_t one = (UINT64_C(1) << prob_bits) - 1;
+  switch (next_random(state) % 8) {
+    case 0: return 0;
+    case 1: return prob_bits == 16 ? UINT64_MAX : (UINT64_C(1) << (4 * prob_bits)) - 1;
+  }
+
+  uint64_t probs = 0;
+  for (int i = 0; i < 4; i++) {
+    uint64_t r = next_random(state);
+    uint64_t part = r % 4 == 0 ? 0 : r % 4 == 1 ? one : (r >> 8) & one;
+    probs |= part << (prob_bits * i);
+  }
+  return probs;
+}
+
+// every entry is found with its probs, and keys that aren't there aren't
+void check_table (const std::string& name, const std::string& path, const std::vector<std::vector<TableEntry>>& segments, int key_bits, uint64_t& state) {
+  TableFile table(path);
+
+  std::size_t total = 0;
+  bool entries_ok = table.num_segments() == static_cast<int>(segments.size());
+  bool found_ok = entries_ok;
+  bool missing_ok = entries_ok;
+  for (int segment = 0; entries_ok && segment < table.num_segments(); segment++) {
+    std::vector<TableEntry> expected = segments[segment];
+    std::sort(expected.begin(), expected.end());
+    total += expected.size();
+
+    std::vector<TableEntry> entries;
+    table.segment_entries(segment, entries);
+    entries_ok &= entries.size() == expected.size() && table.segment_size(segment) == expected.size();
+    for (std::size_t i = 0; entries_ok && i < entries.size(); i++) {
+      entries_ok &= entries[i].key == expected[i].key && entries[i].probs == expected[i].probs;
+    }
+
+    ankerl::unordered_dense::set<uint64_t> keys;
+    for (const TableEntry& entry : expected) {
+      uint64_t probs = ~UINT64_C(0);
+      found_ok &= table.find(segment, entry.key, probs) && probs == entry.probs;
+      keys.insert(entry.key);
+    }
+
+    uint64_t mask = key_bits == 64 ? UINT64_MAX : (UINT64_C(1) << key_bits) - 1;
+    for (int i = 0; i < 1000; i++) {
+      uint64_t key = next_random(state) & mask;
+      uint64_t probs;
+      missing_ok &= keys.count(key) != 0 || !table.find(segment, key, probs);
+    }
+  }
+
+  check(entries_ok && table.num_entries() == total, name + ": segment_entries gives back what was written"s);
+  check(found_ok, name + ": find finds every entry"s);
+  check(missing_ok, name + ": find misses keys that aren't there"s);
+}
+
+void check_table_file () {
+  uint64_t state = 0x2048;
+  const int num_moving_tiles = 8;
+  const int key_bits = num_moving_tiles * 4;
+  const int prob_bits = 14;
+
+  // an empty one too, layers can have shards with no boards
+  std::vector<std::size_t> sizes = {5000, 1, 0, 777};
+  std::vector<std::vector<TableEntry>> segments;
+  std::vector<TableFile::EncodedSegment> encoded;
+  for (std::size_t size : sizes) {
+    std::vector<TableEntry> entries;
+    for (uint64_t key : random_keys(state, size, key_bits)) {
+      entries.push_back({key, random_probs(state, prob_bits)});
+    }
+    segments.push_back(entries);
+    encoded.push_back(TableFile::encode_segment(entries, prob_bits));
+  }
+  TableFile::write("table.txt", encoded, num_moving_tiles, prob_bits);
+  check(!TableFile::is_legacy("table.txt"), "table file: a new file isn't legacy");
+  check_table("table file", "table.txt", segments, key_bits, state);
+
+  // the old format, just key_bytes of key and 7 bytes of probs per entry in any order
+  std::vector<TableEntry> entries;
+  for (uint64_t key : random_keys(state, 3000, key_bits)) {
+    entries.push_back({key, random_probs(state, prob_bits)});
+  }
+  {
+    std::ofstream file("headerless.txt", std::ios::binary);
+    for (const TableEntry& entry : entries) {
+      file.write(reinterpret_cast<const char*>(&entry.key), num_moving_tiles / 2);
+      file.write(reinterpret_cast<const char*>(&entry.probs), 7);
+    }
+  }
+  check(TableFile::is_legacy("headerless.txt"), "table file: a headerless file is legacy");
+
+  // a layer of one board is smaller than a header, it should still say to convert
+  {
+    std::ofstream file("small.txt", std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&entries[0].key), num_moving_tiles / 2);
+    file.write(reinterpret_cast<const char*>(&entries[0].probs), 7);
+  }
+  std::string error;
+  try {
+    TableFile small("small.txt");
+  } catch (const TableFile::table_file_error& ex) {
+    error = ex.what();
+  }
+  check(error.find("old format") != std::string::npos, "table file: opening a small headerless file says it's the old format");
+  TableFile::convert_legacy("headerless.txt", num_moving_tiles);
+  check(!TableFile::is_legacy("headerless.txt"), "table file: a converted file isn't legacy");
+  check_table("converted table file", "headerless.txt", {entries}, key_bits, state);
+}
+
+// the corners of the block codec, with 16 moving tiles so keys use all 64 bits
+void check_table_blocks () {
+  uint64_t state = 0x1024;
+  const int num_moving_tiles = 16;
+  const int key_bits = num_moving_tiles * 4;
+  const int prob_bits = 14;
+  const std::size_t block_entries = 32; // TableFile::BLOCK_ENTRIES
+
+  // full blocks and one over, and a single entry
+  std::vector<std::vector<uint64_t>> keys = {
+    random_keys(state, block_entries, key_bits),
+    random_keys(state, 2 * block_entries, key_bits),
+    random_keys(state, block_entries + 1, key_bits),
+    random_keys(state, 1, key_bits),
+  };
+
+  // gaps of 0, so k is 0 too
+  std::vector<uint64_t> dense;
+  for (uint64_t key = 0; key < 100; key++) {
+    dense.push_back(key);
+  }
+  keys.push_back(dense);
+
+  // k tops out at 56, so a 2^63 gap has a quotient of 128, more zeros than one read
+  keys.push_back({0, UINT64_C(1) << 63, UINT64_MAX});
+
+  std::vector<std::vector<TableEntry>> segments;
+  std::vector<TableFile::EncodedSegment> encoded;
+  for (const std::vector<uint64_t>& segment_keys : keys) {
+    std::vector<TableEntry> entries;
+    for (uint64_t key : segment_keys) {
+      entries.push_back({key, random_probs(state, prob_bits)});
+    }
+    segments.push_back(entries);
+  }
+
+  // nothing but the rows without a pattern, dead and won
+  std::vector<TableEntry> special;
+  for (uint64_t key : random_keys(state, 3 * block_entries, key_bits)) {
+    special.push_back({key, special.size() % 3 == 0 ? 0 : (UINT64_C(1) << (4 * prob_bits)) - 1});
+  }
+  segments.push_back(special);
+
+  for (std::vector<TableEntry> entries : segments) {
+    encoded.push_back(TableFile::encode_segment(entries, prob_bits));
+  }
+  TableFile::write("blocks.txt", encoded, num_moving_tiles, prob_bits);
+  check_table("table blocks", "blocks.txt", segments, key_bits, state);
+}
+
+void check_position_file () {
+  uint64_t state = 0x4096;
+  const std::size_t block_size = PositionFile::BLOCK_SIZE;
+
+  // empty and single board shards, a block exactly full and one board over, and 64 bit keys where k goes up to 56
+  std::vector<std::vector<uint64_t>> segments = {
+    random_keys(state, 5000, 32),
+    {},
+    random_keys(state, 1, 32),
+    random_keys(state, block_size, 32),
+    random_keys(state, block_size + 1, 64),
+  };
+
+  // one huge gap after a dense run, its unary part is far past what one read takes
+  std::vector<uint64_t> gap;
+  for (uint64_t key = 0; key < 1000; key++) {
+    gap.push_back(key);
+  }
+  gap.push_back(UINT64_MAX);
+  segments.push_back(gap);
+
+  std::vector<PositionFile::EncodedSegment> encoded;
+  for (std::vector<uint64_t> keys : segments) {
+    encoded.push_back(PositionFile::encode_segment(keys));
+  }
+  {
+    std::ofstream file("positions.pos", std::ios::binary);
+    std::vector<char> header = PositionFile::encode_header(encoded);
+    file.write(header.data(), header.size());
+    for (const auto& segment : encoded) {
+      file.write(segment.data.data(), segment.data.size());
+    }
+  }
+
+  PositionFile positions("positions.pos");
+  std::size_t total = 0;
+  bool sizes_ok = positions.num_segments() == static_cast<int>(segments.size());
+  bool keys_ok = sizes_ok;
+  std::vector<char> buffer;
+  std::vector<uint64_t> block(block_size);
+  for (int segment = 0; keys_ok && segment < positions.num_segments(); segment++) {
+    std::vector<uint64_t> expected = segments[segment];
+    std::sort(expected.begin(), expected.end());
+    total += expected.size();
+    sizes_ok &= positions.segment_size(segment) == expected.size();
+
+    for (std::size_t begin = 0; keys_ok && begin < expected.size(); begin += block_size) {
+      positions.read_block(segment, begin / block_size, buffer, block.data());
+      std::size_t count = std::min(block_size, expected.size() - begin);
+      keys_ok &= std::equal(block.begin(), block.begin() + count, expected.begin() + begin);
+    }
+  }
+
+  check(sizes_ok && positions.size() == total, "position file: every shard has its number of boards");
+  check(keys_ok, "position file: read_block gives back every shard's boards in order");
+}
+
+void check_policy_file () {
+  uint64_t state = 0x2584;
+  const int key_bits = 32;
+
+  // layers like a table's, sums going up by 2, with an empty and a single board one
+  std::vector<std::size_t> sizes = {20000, 0, 1, 3, 5000};
+  std::vector<std::vector<uint64_t>> layer_keys;
+  std::vector<std::vector<uint8_t>> layer_moves;
+  std::vector<PolicyFile::EncodedLayer> layers;
+  for (std::size_t i = 0; i < sizes.size(); i++) {
+    std::vector<uint64_t> keys = random_keys(state, sizes[i], key_bits);
+    std::vector<uint8_t> moves;
+    for (std::size_t j = 0; j < keys.size(); j++) {
+      moves.push_back(next_random(state) % 4);
+    }
+    layers.push_back(PolicyFile::encode_layer(100 + 2 * i, keys, moves));
+    layer_keys.push_back(keys);
+    layer_moves.push_back(moves);
+  }
+  PolicyFile::write("policy.bin", layers);
+
+  PolicyFile policy("policy.bin");
+  std::size_t total = 0;
+  bool moves_ok = true;
+  for (std::size_t i = 0; i < sizes.size(); i++) {
+    total += sizes[i];
+    for (std::size_t j = 0; j < layer_keys[i].size(); j++) {
+      uint8_t move = 4;
+      moves_ok &= policy.find(100 + 2 * i, layer_keys[i][j], move) && move == layer_moves[i][j];
+    }
+  }
+
+  uint8_t move;
+  check(policy.num_boards() == total, "policy file: has every board");
+  check(moves_ok, "policy file: find gives every board its move");
+  check(!policy.find(99, 0, move) && !policy.find(100 + 2 * sizes.size(), 0, move), "policy file: sums without a layer aren't found");
+}
+
+/**
+ * the moves from before the transpose, kept to check it against. rows go
+ * through the row functions themselves, columns get put together one
+ * nibble at a time, moved like a row and spread back out
+ */
+uint64_t reference_move (uint64_t tiles, Direction dir) {
+  if (dir == Direction::left || dir == Direction::right) {
+    const uint64_t mask16 = 0xFFFF;
+    for (int i = 0; i < 4; i++) {
+      uint16_t row = (tiles & (mask16 << (16 * i))) >> (16 * i);
+      tiles &= (~(mask16 << (16 * i)));
+
+      uint64_t new_row = dir == Direction::right ? lut::move_row_right(row) : lut::move_row_left(row);
+      tiles |= new_row << (16 * i);
+    }
+  } else {
+    uint64_t mask_alternating = 0xF000F000F000F000;
+    for (int i = 0; i < 4; i++) {
+      uint64_t mask = mask_alternating >> (4 * i);
+      uint64_t masked = (tiles & mask);
+      uint16_t row = ((masked >> 4 * (3 - i)) & 0xF) + ((masked >> 4 * (6 - i)) & 0xF0) + ((masked >> 4 * (9 - i)) & 0xF00) + ((masked >> 4 * (12 - i)) & 0xF000);
+      tiles &= ~mask;
+
+      uint64_t new_row = dir == Direction::down ? lut::move_row_right(row) : lut::move_row_left(row);
+
+      uint64_t placed_row = ((new_row & 0xF) << 4 * (3 - i)) + ((new_row & 0xF0) << 4 * (6 - i)) + ((new_row & 0xF00) << 4 * (9 - i)) + ((new_row & 0xF000) << 4 * (12 - i));
+      tiles |= placed_row;
+    }
+  }
+
+  return tiles;
+}
+
+// random tiles, with some copied onto a neighbour so there's something to merge, 32768s too
+uint64_t random_board (uint64_t& state) {
+  uint64_t tiles = 0;
+  for (int pos = 0; pos < 16; pos++) {
+    uint64_t r = next_random(state);
+    uint8_t tile = r % 3 == 0 ? 0 : r % 5 == 0 ? 15 : (r >> 8) % 16;
+    tiles = Board::set_tile(tiles, pos % 4, pos / 4, tile);
+  }
+
+  int pairs = next_random(state) % 6;
+  for (int i = 0; i < pairs; i++) {
+    uint64_t r = next_random(state);
+    int x = r % 4;
+    int y = (r >> 8) % 4;
+    bool across = (r >> 16) % 2;
+    int to_x = across ? (x + 1) % 4 : x;
+    int to_y = across ? y : (y + 1) % 4;
+    tiles = Board::set_tile(tiles, to_x, to_y, Board::get_tile(tiles, x, y));
+  }
+  return tiles;
+}
+
+void check_moves () {
+  uint64_t state = 0x0777;
+  Board board_lut;
+
+  bool moves_ok = true;
+  bool merged = false;
+  bool spilled = false;
+  for (int i = 0; i < 200000; i++) {
+    uint64_t tiles = random_board(state);
+    for (Direction dir : {Direction::up, Direction::right, Direction::down, Direction::left}) {
+      uint64_t expected = reference_move(tiles, dir);
+      moves_ok &= board_lut.move(tiles, dir) == expected;
+      merged |= board_lut.sum_of_tiles(expected) == board_lut.sum_of_tiles(tiles) && __builtin_popcountll(expected) != __builtin_popcountll(tiles);
+      spilled |= board_lut.sum_of_tiles(expected) != board_lut.sum_of_tiles(tiles);
+    }
+  }
+
+  // two 32768s side by side make a 16, which spills into the next tile over
+  uint64_t pair = Board::set_tile(Board::set_tile(0, 2, 1, 15), 3, 1, 15);
+  uint64_t column = Board::set_tile(Board::set_tile(0, 1, 2, 15), 1, 3, 15);
+  for (Direction dir : {Direction::up, Direction::right, Direction::down, Direction::left}) {
+    moves_ok &= board_lut.move(pair, dir) == reference_move(pair, dir);
+    moves_ok &= board_lut.move(column, dir) == reference_move(column, dir);
+  }
+
+  check(merged && spilled, "moves: the random boards merge tiles, 32768s included");
+  check(moves_ok, "moves: every direction matches the nibble by nibble moves");
+}
+
+/**
+ * packing from before pext, kept to check it against. the map lists the
+ * moving positions going down each column, left to right, and a 0 in it
+ * ends the list
+ */
+uint64_t reference_pack (uint64_t tiles, uint64_t static_tiles) {
+  uint64_t moving_tiles_map = 0;
+  int i = 0;
+  for (int x = 0; x < 4; x++) {
+    for (int y = 0; y < 4; y++) {
+      if (!Board::get_tile(static_tiles, x, y)) {
+        moving_tiles_map |= static_cast<uint64_t>(y * 4 + x) << (i * 4);
+        i++;
+      }
+    }
+  }
+
+  uint64_t res = 0;
+  i = 0;
+  while (moving_tiles_map) {
+    res |= static_cast<uint64_t>(Board::get_tile(tiles, moving_tiles_map & 0xF)) << (i * 4);
+    moving_tiles_map >>= 4;
+    i++;
+  }
+  return res;
+}
+
+// a random layout of static tiles, anywhere from none to all of them
+uint64_t random_layout (uint64_t& state) {
+  int density = next_random(state) % 17;
+  uint64_t static_tiles = 0;
+  for (int pos = 0; pos < 16; pos++) {
+    if (static_cast<int>(next_random(state) % 16) < density) {
+      static_tiles = Board::set_tile(static_tiles, pos % 4, pos / 4, 1 + next_random(state) % 15);
+    }
+  }
+  return static_tiles;
+}
+
+void check_packing () {
+  uint64_t state = 0x5a5a;
+
+#if defined(__x86_64__)
+  bool bmi2 = Board::has_bmi2();
+#else
+  bool bmi2 = false;
+#endif
+
+  bool mask_ok = true;
+  bool old_order_ok = true;
+  bool round_trip_ok = true;
+  bool portable_ok = true;
+  bool bmi2_ok = true;
+  for (int i = 0; i < 20000; i++) {
+    uint64_t static_tiles = random_layout(state);
+    uint64_t pack_mask = Board::make_pack_mask(static_tiles);
+
+    int num_moving = 0;
+    uint64_t moving_nibbles = 0;
+    for (int pos = 0; pos < 16; pos++) {
+      if (!Board::get_tile(static_tiles, pos)) {
+        num_moving++;
+        moving_nibbles |= UINT64_C(0xF) << (60 - pos * 4);
+      }
+    }
+    mask_ok &= __builtin_popcountll(pack_mask) == num_moving * 4;
+
+    for (int j = 0; j < 20; j++) {
+      uint64_t tiles = random_board(state);
+      uint64_t packed = Board::pack_tiles(tiles, pack_mask);
+
+      // the top left corner on its own is the one layout the old packing got wrong, see below
+      bool only_corner = num_moving == 1 && !Board::get_tile(static_tiles, 0);
+      old_order_ok &= only_corner || packed == reference_pack(tiles, static_tiles);
+      old_order_ok &= num_moving == 16 || (packed >> (num_moving * 4)) == 0;
+      round_trip_ok &= Board::unpack_tiles(packed, pack_mask) == (tiles & moving_nibbles);
+
+      uint64_t column = Board::column_major(tiles);
+      portable_ok &= Board::pext_portable(column, pack_mask) == packed;
+      portable_ok &= Board::pdep_portable(packed, pack_mask) == (column & pack_mask);
+#if defined(__x86_64__)
+      if (bmi2) {
+        bmi2_ok &= Board::pext_bmi2(column, pack_mask) == Board::pext_portable(column, pack_mask);
+        bmi2_ok &= Board::pdep_bmi2(packed, pack_mask) == Board::pdep_portable(packed, pack_mask);
+      }
+#endif
+    }
+  }
+
+  /**
+   * only the top left corner moving, the old map for it was all 0s so
+   * every board packed to 0. now it packs to the tile that's there
+   */
+  uint64_t corner_layout = 0;
+  for (int pos = 1; pos < 16; pos++) {
+    corner_layout = Board::set_tile(corner_layout, pos % 4, pos / 4, 1);
+  }
+  uint64_t corner_mask = Board::make_pack_mask(corner_layout);
+  bool corner_ok = true;
+  for (uint8_t tile = 0; tile < 16; tile++) {
+    uint64_t tiles = Board::set_tile(corner_layout, 0, 0, tile);
+    corner_ok &= Board::pack_tiles(tiles, corner_mask) == tile;
+    corner_ok &= Board::pext_portable(Board::column_major(tiles), corner_mask) == tile;
+    corner_ok &= reference_pack(tiles, corner_layout) == 0;
+    corner_ok &= Board::unpack_tiles(tile, corner_mask) == Board::set_tile(0, 0, 0, tile);
+  }
+
+  check(mask_ok, "packing: the pack mask has a nibble for every moving tile");
+  check(old_order_ok, "packing: moving tiles are packed in the old order");
+  check(round_trip_ok, "packing: unpacking gives back the moving tiles");
+  check(portable_ok, "packing: the portable pext and pdep match pack_tiles and unpack_tiles");
+  check(bmi2_ok, bmi2 ? "packing: the bmi2 pext and pdep match the portable ones"s : "packing: no bmi2 here, only the portable path was checked"s);
+  check(corner_ok, "packing: the top left corner alone packs to its tile, the old packing gave 0");
+}
+
+// pack_probs and unpack_probs at every precision, then a table of what they made
+void check_precision () {
+  uint64_t state = 0x4181;
+  const int num_moving_tiles = 8;
+  const int key_bits = num_moving_tiles * 4;
+
+  Board board_lut;
+  TableGenerator packer(board_lut, "table_precision", 0, 0, 7, 0, 1);
+
+  for (int bits : {8, 12, 14, 16, TableGenerator::LEGACY_PRECISION}) {
+    packer.set_precision(bits);
+    int prob_bits = packer.prob_bits();
+    std::string name = bits == TableGenerator::LEGACY_PRECISION ? "legacy precision"s : std::to_string(bits) + " bit precision"s;
+
+    // legacy rounds down and comes back a whole 1/2^14 step up, so it's off by up to a step, the others half of one
+    float rounding = bits == TableGenerator::LEGACY_PRECISION ? 1.0f / (1 << 14) : 0.5f / ((1 << bits) - 1);
+    float tolerance = rounding + 1e-7f; // and a couple of float ulps near 1, they matter at 16 bits
+
+    std::array<float, 4> ends = {0, 1, 1, 0};
+    check(packer.unpack_probs(packer.pack_probs(ends)) == ends, name + ": 0 and 1 come back exactly"s);
+
+    bool close_ok = true;
+    bool repack_ok = true;
+    std::vector<TableEntry> entries;
+    for (uint64_t key : random_keys(state, 5000, key_bits)) {
+      std::array<float, 4> probs;
+      for (float& prob : probs) {
+        prob = (next_random(state) >> 40) / static_cast<float>(1 << 24);
+      }
+
+      uint64_t packed = packer.pack_probs(probs);
+      std::array<float, 4> unpacked = packer.unpack_probs(packed);
+      for (int i = 0; i < 4; i++) {
+        close_ok &= std::fabs(unpacked[i] - probs[i]) <= tolerance;
+      }
+
+      // legacy doesn't come back to the same bits, it's a whole step up by design
+      if (bits != TableGenerator::LEGACY_PRECISION) {
+        repack_ok &= packer.pack_probs(unpacked) == packed;
+      }
+      entries.push_back({key, packed});
+    }
+    check(close_ok, name + ": unpacking is off by at most the rounding"s);
+    check(repack_ok, name + ": packing what was unpacked gives the same bits"s);
+
+    std::vector<TableFile::EncodedSegment> encoded = {TableFile::encode_segment(entries, prob_bits)};
+    std::string path = "precision_"s + std::to_string(bits) + ".txt"s;
+    TableFile::write(path, encoded, num_moving_tiles, prob_bits);
+    check_table(name + " table"s, path, {entries}, key_bits, state);
+  }
+}
+
+
+/**
+ * a plain recursive expectimax, what a generated table should come to
+ * give or take the rounding. best is memoized by board, so once it's run
+ * from the start board it has every board of the game in it
+ */
+struct Expectimax {
+  Board& board_lut;
+  uint64_t static_tiles;
+  uint64_t static_tiles_mask;
+  uint8_t goal_tile;
+  ankerl::unordered_dense::map<uint64_t, double> best;
+
+  Expectimax (Board& board_lut, uint64_t static_tiles, uint8_t goal_tile): board_lut(board_lut), static_tiles(static_tiles), static_tiles_mask(board_lut.make_static_tiles_mask(static_tiles)), goal_tile(goal_tile) {}
+
+  double move_prob (uint64_t board, Direction dir) {
+    uint64_t moved = board_lut.move(board, dir);
+    if (moved == board || (moved & static_tiles_mask) != static_tiles) {
+      return 0;
+    }
+
+    int num_empty = 0;
+    for (int pos = 0; pos < 16; pos++) {
+      num_empty += Board::get_tile(moved, pos) == 0;
+    }
+
+    double prob = 0;
+    for (int pos = 0; pos < 16; pos++) {
+      if (Board::get_tile(moved, pos) == 0) {
+        prob += 0.9 / num_empty * best_prob(Board::set_tile(moved, pos % 4, pos / 4, 1));
+        prob += 0.1 / num_empty * best_prob(Board::set_tile(moved, pos % 4, pos / 4, 2));
+      }
+    }
+    return prob;
+  }
+
+  std::array<double, 4> probs (uint64_t board) {
+    if (board_lut.game_over(board)) {
+      return {0, 0, 0, 0};
+    }
+    if (board_lut.num_tiles(board, goal_tile) > 1) {
+      return {1, 1, 1, 1};
+    }
+    return {move_prob(board, Direction::up), move_prob(board, Direction::right), move_prob(board, Direction::down), move_prob(board, Direction::left)};
+  }
+
+  double best_prob (uint64_t board) {
+    auto it = best.find(board);
+    if (it != best.end()) {
+      return it->second;
+    }
+
+    std::array<double, 4> board_probs = probs(board);
+    double prob = *std::max_element(board_probs.begin(), board_probs.end());
+    best[board] = prob;
+    return prob;
+  }
+};
+
+// the furthest a table is from the expectimax over every board of the game, infinite if one's missing
+double table_error (TableGenerator& table, Expectimax& expected) {
+  double error = 0;
+  for (const auto& [board, best] : expected.best) {
+    std::array<double, 4> probs = expected.probs(board);
+    try {
+      MoveProbs move_probs = table.read_table(board);
+      for (int i = 0; i < 4; i++) {
+        error = std::max(error, std::fabs(move_probs.probs[i] - probs[i]));
+      }
+    } catch (const std::runtime_error& ex) {
+      return INFINITY;
+    }
+  }
+  return error;
+}
+
+// the same, between two tables
+double table_difference (TableGenerator& table, TableGenerator& other, Expectimax& expected) {
+  double difference = 0;
+  for (const auto& [board, best] : expected.best) {
+    try {
+      MoveProbs move_probs = table.read_table(board);
+      MoveProbs other_probs = other.read_table(board);
+      for (int i = 0; i < 4; i++) {
+        difference = std::max(difference, static_cast<double>(std::fabs(move_probs.probs[i] - other_probs.probs[i])));
+      }
+    } catch (const std::runtime_error& ex) {
+      return INFINITY;
+    }
+  }
+  return difference;
+}
+
+std::size_t table_entries (const std::string& table_dir) {
+  std::size_t entries = 0;
+  for (const auto& entry : std::filesystem::directory_iterator(table_dir)) {
+    std::string stem = entry.path().stem().string();
+    if (entry.path().extension() == ".txt" && !stem.empty() && std::all_of(stem.begin(), stem.end(), ::isdigit)) {
+      entries += TableFile(entry.path().string()).num_entries();
+    }
+  }
+  return entries;
+}
+
+// the generator says how it's going on cout, that stays out of the check's output
+std::string quietly (const std::function<void()>& run) {
+  std::ostringstream out;
+  std::streambuf* old = std::cout.rdbuf(out.rdbuf());
+  try {
+    run();
+  } catch (...) {
+    std::cout.rdbuf(old);
+    throw;
+  }
+  std::cout.rdbuf(old);
+  return out.str();
+}
+
+// the biggest of a field over the evaluate records of <table>/telemetry.jsonl
+uint64_t most_in_telemetry (const std::string& table_dir, const std::string& field) {
+  std::ifstream file(table_dir + "/telemetry.jsonl"s);
+  std::string line;
+  uint64_t most = 0;
+  while (std::getline(file, line)) {
+    std::size_t at = line.find("\""s + field + "\": "s);
+    if (line.find("\"evaluate\"") != std::string::npos && at != std::string::npos) {
+      most = std::max<uint64_t>(most, std::stoull(line.substr(at + field.size() + 4)));
+    }
+  }
+  return most;
+}
+
+/**
+ * small tables made every way there is, against each other and against
+ * Expectimax: in memory, then from the same positions with other threads
+ * and a budget so small every layer takes passes, then picked up again
+ * halfway through evaluating, and the lower of two goals on its own
+ */
+void check_generation () {
+  Board board_lut;
+
+  // 6 spaces, the static tiles are all bigger than the goals so nothing merges with them
+  uint64_t static_tiles = Board::load_board({{
+    {256, 512, 1024, 2048},
+    {4096, 8192, 16384, 32768},
+    {256, 512, 0, 0},
+    {0, 0, 0, 0}
+  }});
+  uint64_t root = static_tiles | Board::load_board({{{0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {2, 2, 0, 0}}});
+  const std::size_t tiny_budget = 16 << 10;
+
+  Expectimax expected(board_lut, static_tiles, 6);
+  Expectimax expected_lower(board_lut, static_tiles, 5);
+  expected.best_prob(root);
+  expected_lower.best_prob(root);
+
+  // the table's own rounding, once more on a resume where the lookahead comes from the tables, and the lookahead's every layer
+  int top_sum = 0;
+  for (const auto& [board, best] : expected.best) {
+    top_sum = std::max(top_sum, board_lut.sum_of_tiles(board));
+  }
+  int original_sum = board_lut.sum_of_tiles(root);
+  int layers = (top_sum - original_sum) / 2 + 1;
+  double step = 1.0 / ((1 << TableGenerator::DEFAULT_PRECISION) - 1);
+  double bound = step + layers * 0.5 / 65535 + 1e-6;
+
+  std::string in_memory_output = quietly([&] {
+    TableGenerator generator(board_lut, "table_memory", root, static_tiles, 6, 1000, 2);
+    generator.set_memory_budget(std::size_t(1) << 30);
+    generator.add_goal(5, "table_memory_32");
+    generator.generate_table();
+  });
+
+  std::string passes_output = quietly([&] {
+    TableGenerator generator(board_lut, "table_passes", root, static_tiles, 6, 0, 3);
+    generator.set_memory_budget(tiny_budget);
+    generator.add_goal(5, "table_passes_32");
+    generator.generate_table();
+  });
+
+  quietly([&] {
+    TableGenerator generator(board_lut, "table_lower", root, static_tiles, 5, 0, 1);
+    generator.generate_table();
+  });
+
+  // the run dies once the tables above the middle layer are written, then it's picked up from progress.txt
+  int resume_sum = original_sum + (layers / 2) * 2;
+  for (const std::string& table_dir : {"table_passes"s, "table_passes_32"s}) {
+    for (int sum = original_sum; sum <= resume_sum; sum += 2) {
+      std::filesystem::remove(table_dir + "/" + std::to_string(sum) + ".txt");
+    }
+  }
+  std::ofstream("table_passes/progress.txt")
+    << "phase evaluate" << std::endl
+    << "tile_sum " << resume_sum << std::endl
+    << "top_sum " << top_sum << std::endl
+    << "shards " << TableGenerator::NUM_SHARDS << std::endl
+    << "positions " << TableGenerator::positions_dir_for(root, static_tiles, 6) << std::endl
+    << "tables " << resume_sum + 2 << " " << top_sum << std::endl
+    << "lookahead " << resume_sum + 2 << " " << resume_sum + 4 << std::endl
+    << "goal 5 table_passes_32" << std::endl;
+
+  TableGenerator::Progress progress;
+  bool progress_ok = TableGenerator::read_progress("table_passes", progress) && progress.tile_sum == resume_sum && progress.extra_goals.size() == 1;
+  std::string resume_output = quietly([&] {
+    TableGenerator generator(board_lut, "table_passes", root, static_tiles, 6, 0, 2);
+    generator.set_memory_budget(tiny_budget);
+    for (const auto& goal : progress.extra_goals) {
+      generator.add_goal(goal.first, goal.second);
+    }
+    generator.resume_table(progress);
+  });
+  progress_ok &= TableGenerator::read_progress("table_passes", progress) && progress.phase == "done";
+
+  TableGenerator in_memory(board_lut, "table_memory", root, static_tiles, 6, 0, 0);
+  TableGenerator in_memory_lower(board_lut, "table_memory_32", root, static_tiles, 5, 0, 0);
+  TableGenerator passes(board_lut, "table_passes", root, static_tiles, 6, 0, 0);
+  TableGenerator passes_lower(board_lut, "table_passes_32", root, static_tiles, 5, 0, 0);
+  TableGenerator lower(board_lut, "table_lower", root, static_tiles, 5, 0, 0);
+
+  // the lower goal's table only has its own game, without the boards it already won
+  std::size_t lower_game = 0;
+  for (const auto& [board, best] : expected_lower.best) {
+    lower_game += board_lut.num_tiles(board, 5) <= 1;
+  }
+
+  // scrambled keys spread the boards evenly over the slices passes are made of
+  std::vector<std::size_t> slices(LayerStore::NUM_SLICES, 0);
+  for (const auto& [board, best] : expected.best) {
+    slices[LayerStore::slice_of(Board::pack_tiles(board, Board::make_pack_mask(static_tiles)), 6)]++;
+  }
+  std::size_t fullest_slice = *std::max_element(slices.begin(), slices.end());
+
+  check(table_error(in_memory, expected) <= bound, "generation: a table made in memory matches the expectimax");
+  check(table_error(in_memory_lower, expected_lower) <= bound, "generation: so does the lower goal made along with it");
+  check(in_memory_output.find("Generating positions") != std::string::npos && in_memory_output.find("passes") == std::string::npos, "generation: the first table generates the positions and needs no passes");
+  check(passes_output.find("Using the positions already") != std::string::npos, "generation: a table with other threads uses the same positions");
+  check(most_in_telemetry("table_passes", "passes") > 1 && most_in_telemetry("table_passes", "largest_pass_bytes") <= tiny_budget, "generation: a tiny memory budget evaluates in passes that fit in it");
+  check(fullest_slice <= 2 * expected.best.size() / LayerStore::NUM_SLICES, "generation: scrambled keys spread the boards evenly over the slices");
+  check(progress_ok && resume_output.find("Resuming at sum "s + std::to_string(resume_sum)) != std::string::npos, "generation: evaluating picks up again from progress.txt");
+  check(table_error(passes, expected) <= bound && table_error(passes_lower, expected_lower) <= bound, "generation: the table made in passes and resumed matches the expectimax, both goals");
+  check(table_difference(in_memory, passes, expected) <= step + 1e-7, "generation: the tables made in memory and in passes are at most a step apart");
+  check(table_entries("table_lower") == expected_lower.best.size() && table_entries("table_memory_32") == lower_game, "generation: a lower goal only keeps its own game, without the boards it won");
+  check(table_difference(in_memory_lower, lower, expected_lower) == 0, "generation: a lower goal comes out the same as its own table");
+}
+
+}
+
+int main () {
+  std::string work_dir = (std::filesystem::temp_directory_path() / "tables_check_XXXXXX").string();
+  if (mkdtemp(work_dir.data()) == nullptr || chdir(work_dir.c_str()) != 0) {
+    std::cerr << "Could not make a work directory" << std::endl;
+    return 1;
+  }
+
+  try {
+    check_table_file();
+    check_table_blocks();
+    check_position_file();
+    check_policy_file();
+    check_precision();
+    check_moves();
+    check_packing();
+    check_generation();
+  } catch (const std::runtime_error& ex) {
+    check(false, ex.what());
+  }
+
+  std::filesystem::remove_all(work_dir);
+
+  std::cout << (failures == 0 ? "All checks passed"s : std::to_string(failures) + " checks failed"s) << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * bit level writing and reading for the compressed file formats, bits go
+ * LSB first. Rice codes split a value into value >> k in unary (zeros,
+ * then a one) and the low k bits as they are
+ */
+
+// appends to out, at most 56 bits per put
+struct BitWriter {
+  std::vector<char>& out;
+  uint64_t bits = 0;
+  int num_bits = 0;
+
+  BitWriter (std::vector<char>& out): out(out) {}
+
+  void put (uint64_t value, int count) {
+    bits |= value << num_bits;
+    num_bits += count;
+    while (num_bits >= 8) {
+      out.push_back(static_cast<char>(bits & 0xFF));
+      bits >>= 8;
+      num_bits -= 8;
+    }
+  }
+
+  // k can be at most 56
+  void put_rice (uint64_t value, int k) {
+    for (uint64_t quotient = value >> k; quotient > 0; ) {
+      int zeros = quotient < 56 ? quotient : 56;
+      put(0, zeros);
+      quotient -= zeros;
+    }
+    put(1, 1);
+    put(k == 0 ? 0 : value & ((UINT64_C(1) << k) - 1), k);
+  }
+
+  // pads the last byte with zeros
+  void flush () {
+    if (num_bits > 0) {
+      out.push_back(static_cast<char>(bits & 0xFF));
+    }
+    bits = 0;
+    num_bits = 0;
+  }
+};
+
+/**
+ * reads a whole word at a time, so the 8 bytes after the last bit read
+ * have to be readable memory (their contents don't matter)
+ */
+struct BitReader {
+  const char* data;
+  uint64_t position = 0;
+
+  BitReader (const char* data): data(data) {}
+
+  // at least the next 57 bits in the low bits
+  uint64_t peek () const {
+    uint64_t word;
+    std::memcpy(&word, data + (position >> 3), sizeof word);
+    return word >> (position & 7);
+  }
+
+  // count can be at most 56
+  uint64_t get (int count) {
+    uint64_t value = count == 0 ? 0 : peek() & ((UINT64_C(1) << count) - 1);
+    position += count;
+    return value;
+  }
+
+  uint64_t get_rice (int k) {
+    // nearly always the whole code is in one word
+    uint64_t word = peek();
+    int zeros = __builtin_ctzll(word | (UINT64_C(1) << 56));
+    if (zeros + 1 + k <= 56) {
+      position += zeros + 1 + k;
+      return (static_cast<uint64_t>(zeros) << k) | ((word >> (zeros + 1)) & ((UINT64_C(1) << k) - 1));
+    }
+
+    uint64_t quotient = 0;
+    while (true) {
+      uint64_t word = peek() & ((UINT64_C(1) << 56) - 1);
+      if (word != 0) {
+        int zeros = __builtin_ctzll(word);
+        quotient += zeros;
+        position += zeros + 1;
+        break;
+      }
+      quotient += 56;
+      position += 56;
+    }
+    return (quotient << k) | get(k);
+  }
+};
+
+// bits put_rice takes for value
+inline uint64_t rice_bits (uint64_t value, int k) {
+  return (value >> k) + 1 + k;
+}
+
+// a good k for values averaging average, log2 of it
+inline int rice_parameter (uint64_t average) {
+  int k = average <= 1 ? 0 : 63 - __builtin_clzll(average);
+  return k > 56 ? 56 : k;
+}
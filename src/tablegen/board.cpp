@@ -1,25 +1,20 @@
 #include <cmath>
 #include <iostream>
-#include <fstream>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "board.h"
 
-void Board::load_lut (const std::string& file) {
-  std::ifstream lut_file(file);
-  if (!lut_file.is_open()) {
-    std::cerr << "Could not open LUT file: " << file << std::endl;
-    exit(1);
-  }
-  int right;
-  int left;
-  int empty;
+// constexpr so it's done by the compiler, copying it is still a constant
+static constexpr std::array<lut::RowMoves, 16384> move_lut_0 = lut::make_move_lut_quarter(0);
+static constexpr std::array<lut::RowMoves, 16384> move_lut_1 = lut::make_move_lut_quarter(1);
+static constexpr std::array<lut::RowMoves, 16384> move_lut_2 = lut::make_move_lut_quarter(2);
+static constexpr std::array<lut::RowMoves, 16384> move_lut_3 = lut::make_move_lut_quarter(3);
+static constexpr std::array<lut::RowMoves, 65536> move_lut = lut::join_move_lut(move_lut_0, move_lut_1, move_lut_2, move_lut_3);
+static constexpr std::array<uint16_t, 65536> empty_lut = lut::make_empty_lut();
 
-  int i = 0;
-  while (lut_file >> right >> left >> empty) {
-    _move_lut[i] = {right, left};
-    _empty_lut[i] = empty;
-    i++;
-  }
-}
+const std::array<lut::RowMoves, 65536> Board::_move_lut = move_lut;
+const std::array<uint16_t, 65536> Board::_empty_lut = empty_lut;
 
 uint64_t Board::load_board (const std::array<std::array<int, 4>, 4>& board) {
   uint64_t tiles = 0;
@@ -42,31 +37,48 @@ void Board::print (std::ostream& out, uint64_t tiles) {
 }
 
 
+uint64_t Board::transpose (uint64_t tiles) {
+  /**
+   * swaps x and y in three steps: nibbles one off the diagonal, then the
+   * 2x2 blocks off the diagonal. each step masks out what moves and
+   * shifts it across, see the "bit twiddling" matrix transpose trick
+   */
+  uint64_t a1 = tiles & 0xF0F00F0FF0F00F0F;
+  uint64_t a2 = tiles & 0x0000F0F00000F0F0;
+  uint64_t a3 = tiles & 0x0F0F00000F0F0000;
+  uint64_t a = a1 | (a2 << 12) | (a3 >> 12);
+
+  uint64_t b1 = a & 0xFF00FF0000FF00FF;
+  uint64_t b2 = a & 0x00FF00FF00000000;
+  uint64_t b3 = a & 0x00000000FF00FF00;
+  return b1 | (b2 >> 24) | (b3 << 24);
+}
+
+uint64_t Board::move_rows (uint64_t tiles, bool right) {
+  uint64_t res = 0;
+  for (int i = 0; i < 4; i++) {
+    uint16_t row = tiles >> (16 * i);
+    uint64_t new_row = right ? _move_lut[row].right : _move_lut[row].left;
+    res |= new_row << (16 * i);
+  }
+
+  return res;
+}
+
 uint64_t Board::move (uint64_t tiles, Direction dir) {
-  if (dir == Direction::left || dir == Direction::right) {
-    const uint64_t mask16 = 0xFFFF;
-    for (int i = 0; i < 4; i++) {
-      uint16_t row = (tiles & (mask16 << (16 * i))) >> (16 * i);
-      tiles &= (~(mask16 << (16 * i)));
-
-      uint64_t new_row = dir == Direction::right ? _move_lut[row].first : _move_lut[row].second;
-      tiles |= new_row << (16 * i);
-    }
-  } else {
-    uint64_t mask_alternating = 0xF000F000F000F000;
-    for (int i = 0; i < 4; i++) {
-      uint64_t mask = mask_alternating >> (4 * i);
-      uint64_t masked = (tiles & mask);
-      // grabbing each of these 2 bytes one by one and combining them
-      uint16_t row = ((masked >> 4 * (3 - i)) & 0xF) + ((masked >> 4 * (6 - i)) & 0xF0) + ((masked >> 4 * (9 - i)) & 0xF00) + ((masked >> 4 * (12 - i)) & 0xF000);
-      tiles &= ~mask;
-
-      uint64_t new_row = dir == Direction::down ? _move_lut[row].first : _move_lut[row].second;
-
-      // reverse the process
-      uint64_t placed_row = ((new_row & 0xF) << 4 * (3 - i)) + ((new_row & 0xF0) << 4 * (6 - i)) + ((new_row & 0xF00) << 4 * (9 - i)) + ((new_row & 0xF000) << 4 * (12 - i));
-      tiles |= placed_row;
-    }
+  /**
+   * columns become rows after a transpose, with y = 0 in the high nibble
+   * like x = 0 is, so up is a left move and down is a right move
+   */
+  switch (dir) {
+    case Direction::left:
+      return move_rows(tiles, false);
+    case Direction::right:
+      return move_rows(tiles, true);
+    case Direction::up:
+      return transpose(move_rows(transpose(tiles), false));
+    case Direction::down:
+      return transpose(move_rows(transpose(tiles), true));
   }
 
   return tiles;
@@ -112,6 +124,16 @@ int Board::sum_of_tiles (uint64_t tiles) { // this is not time-sensitive
   return sum;
 }
 
+int Board::sum_of_tiles_above (uint64_t tiles, uint8_t tile) {
+  int sum = 0;
+  for (int i = 0; i < 16; i++) {
+    int tile_here = ((tiles >> (i * 4)) & 0xF);
+    sum += tile_here > tile ? 1 << tile_here : 0;
+  }
+
+  return sum;
+}
+
 uint64_t Board::make_static_tiles_mask (uint64_t static_tiles) {
   uint64_t static_tiles_mask = 0;
 
@@ -126,39 +148,94 @@ uint64_t Board::make_static_tiles_mask (uint64_t static_tiles) {
   return static_tiles_mask;
 }
 
-uint64_t Board::make_moving_tiles_map (uint64_t static_tiles) {
-  uint64_t moving_tiles_map = 0;
-
-  int i = 0;
-  for (int x = 0; x < 4; x++) {
-    for (int y = 0; y < 4; y++) {
-      if (!get_tile(static_tiles, x, y)) {
-        moving_tiles_map |= static_cast<uint64_t>(y * 4 + x) << (i * 4);
-        i++;
-      }
-    }
-  }
+uint64_t Board::column_major (uint64_t tiles) {
+  /**
+   * puts the tile at (x, y) in nibble x * 4 + y counting from the bottom,
+   * the transpose handles x and y, and reversing the nibbles flips it
+   * to count from the bottom
+   */
+  tiles = __builtin_bswap64(transpose(tiles));
+  return ((tiles & 0x0F0F0F0F0F0F0F0F) << 4) | ((tiles >> 4) & 0x0F0F0F0F0F0F0F0F);
+}
 
-  return moving_tiles_map;
+uint64_t Board::from_column_major (uint64_t tiles) {
+  tiles = __builtin_bswap64(tiles);
+  tiles = ((tiles & 0x0F0F0F0F0F0F0F0F) << 4) | ((tiles >> 4) & 0x0F0F0F0F0F0F0F0F);
+  return transpose(tiles);
 }
 
-uint64_t Board::pack_tiles (uint64_t tiles, uint64_t moving_tiles_map) {
+uint64_t Board::make_pack_mask (uint64_t static_tiles) {
   /**
-   * moving_tiles_map has all the locations of the tiles that are moving
-   * for example if positions 1, 2, and 3 are moving then moving_tiles_map
-   * will be 0x0000000000000123
+   * a full nibble for every tile that moves, in column major order so
+   * packing keeps the old order of going down each column, left to right
    */
+  uint64_t moving_mask = 0;
+  for (int pos = 0; pos < 16; pos++) {
+    if (!get_tile(static_tiles, pos)) {
+      moving_mask |= MASK << (60 - pos * 4);
+    }
+  }
 
-  uint64_t res = 0;
+  return column_major(moving_mask);
+}
 
+uint64_t Board::pext_portable (uint64_t x, uint64_t mask) {
+  // the mask is always whole nibbles, so this goes a nibble at a time
+  uint64_t res = 0;
   int i = 0;
-  while (moving_tiles_map) {
-    int pos = moving_tiles_map & 0xF;
-    res |= (static_cast<uint64_t>(get_tile(tiles, pos)) << (i * 4));
-
-    moving_tiles_map >>= 4;
+  while (mask) {
+    int shift = __builtin_ctzll(mask);
+    res |= ((x >> shift) & 0xF) << (i * 4);
+    mask &= ~(UINT64_C(0xF) << shift);
     i++;
   }
 
   return res;
 }
+
+uint64_t Board::pdep_portable (uint64_t x, uint64_t mask) {
+  uint64_t res = 0;
+  while (mask) {
+    int shift = __builtin_ctzll(mask);
+    res |= (x & 0xF) << shift;
+    mask &= ~(UINT64_C(0xF) << shift);
+    x >>= 4;
+  }
+
+  return res;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("bmi2"))) uint64_t Board::pext_bmi2 (uint64_t x, uint64_t mask) {
+  return _pext_u64(x, mask);
+}
+
+__attribute__((target("bmi2"))) uint64_t Board::pdep_bmi2 (uint64_t x, uint64_t mask) {
+  return _pdep_u64(x, mask);
+}
+
+bool Board::has_bmi2 () {
+  __builtin_cpu_init(); // we can run before main, when this isn't done yet
+  return __builtin_cpu_supports("bmi2");
+}
+
+static uint64_t (*const pext_impl)(uint64_t, uint64_t) = Board::has_bmi2() ? Board::pext_bmi2 : Board::pext_portable;
+static uint64_t (*const pdep_impl)(uint64_t, uint64_t) = Board::has_bmi2() ? Board::pdep_bmi2 : Board::pdep_portable;
+#else
+static uint64_t (*const pext_impl)(uint64_t, uint64_t) = Board::pext_portable;
+static uint64_t (*const pdep_impl)(uint64_t, uint64_t) = Board::pdep_portable;
+#endif
+
+uint64_t Board::pack_tiles (uint64_t tiles, uint64_t pack_mask) {
+  /**
+   * packs just the moving tiles next to each other, the first one going
+   * down the leftmost column ends up in the lowest nibble. with bmi2 this
+   * is one pext, otherwise it's a loop over the nibbles
+   */
+  return pext_impl(column_major(tiles), pack_mask);
+}
+
+uint64_t Board::unpack_tiles (uint64_t packed, uint64_t pack_mask) {
+  // only the moving tiles come back, OR the static tiles back in yourself
+  return from_column_major(pdep_impl(packed, pack_mask));
+}
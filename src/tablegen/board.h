@@ -5,6 +5,8 @@
 #include <iostream>
 #include <utility>
 
+#include "lut.h"
+
 
 enum class Direction {
   up,
@@ -17,15 +19,13 @@ class Board {
 private:
   static const uint64_t MASK = 0b1111;
 
-  // this can't be here, need to fix
-  std::array<std::pair<uint16_t, uint16_t>, 65536> _move_lut;
-  std::array<uint16_t, 65536> _empty_lut;
+  // built at compile time in board.cpp, and shared by every board
+  static const std::array<lut::RowMoves, 65536> _move_lut;
+  static const std::array<uint16_t, 65536> _empty_lut;
 
-  void load_lut (const std::string& file);
+  static uint64_t move_rows (uint64_t tiles, bool right);
 public:
-  Board () {
-    load_lut("src/lut/lut.txt");
-  }
+  Board () {}
 
   // value is 1-16
   static uint8_t get_tile (uint64_t tiles, int x, int y) {
@@ -55,14 +55,32 @@ public:
   static uint64_t load_board (const std::array<std::array<int, 4>, 4>& board);
   static void print (std::ostream& out, uint64_t tiles);
 
+  // swaps x and y
+  static uint64_t transpose (uint64_t tiles);
+
   uint64_t move(uint64_t tiles, Direction dir);
   bool game_over (uint64_t tiles);
   uint16_t get_empty_squares (uint64_t tiles);
 
   int num_tiles (uint64_t tiles, uint8_t tile);
   int sum_of_tiles (uint64_t tiles);
+  int sum_of_tiles_above (uint64_t tiles, uint8_t tile); // only the ones bigger than tile
 
   uint64_t make_static_tiles_mask (uint64_t static_tiles);
-  uint64_t make_moving_tiles_map (uint64_t static_tiles);
-  uint64_t pack_tiles (uint64_t tiles, uint64_t moving_tiles_map);
+  static uint64_t column_major (uint64_t tiles);
+  static uint64_t from_column_major (uint64_t tiles);
+
+  // pack_mask is from make_pack_mask, it only depends on the static tiles
+  static uint64_t make_pack_mask (uint64_t static_tiles);
+  static uint64_t pack_tiles (uint64_t tiles, uint64_t pack_mask);
+  static uint64_t unpack_tiles (uint64_t packed, uint64_t pack_mask);
+
+  // what pack/unpack_tiles use underneath, public so they can be checked
+  static uint64_t pext_portable (uint64_t x, uint64_t mask);
+  static uint64_t pdep_portable (uint64_t x, uint64_t mask);
+#if defined(__x86_64__)
+  static bool has_bmi2 ();
+  static uint64_t pext_bmi2 (uint64_t x, uint64_t mask);
+  static uint64_t pdep_bmi2 (uint64_t x, uint64_t mask);
+#endif
 };
\ No newline at end of file
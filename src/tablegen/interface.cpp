@@ -3,8 +3,13 @@
 #include <chrono>
 #include <cmath>
 #include <fstream>
+#include <algorithm>
+#include <thread>
+#include <charconv>
 
 #include "interface.h"
+#include "server.h"
+#include "planner.h"
 
 using namespace std::literals::string_literals;
 
@@ -20,8 +25,43 @@ std::string Interface::board_to_hash (uint64_t board, Board& board_lut) {
   return hash.str();
 }
 
+static int hex_digit (char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// all of text as a number. stoi throws on a typo, and nothing catches that
+template <typename T>
+static bool parse_number (const std::string& text, T& value) {
+  const char* end = text.data() + text.size();
+  auto result = std::from_chars(text.data(), end, value);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
+static int usage () {
+  std::cerr
+    << "Usage:" << std::endl
+    << "  tables                                          interactive mode" << std::endl
+    << "  tables serve <table> [--socket path] [--threads n] [--policy]" << std::endl
+    << "  tables policy <table>                           export the best moves, for serve --policy" << std::endl
+    << "  tables plan <start hash> <static hash> <goal tile> [--samples n] [--seed n]" << std::endl;
+  return 1;
+}
+
+bool Interface::valid_hash (const std::string& hash) {
+  return hash.size() == 16 && std::all_of(hash.begin(), hash.end(), [](char c) { return hex_digit(c) >= 0; });
+}
+
 uint64_t Interface::hash_to_board (const std::string& hash, Board& board_lut) {
-  if (hash.size() != 16) {
+  if (!valid_hash(hash)) {
     std::cerr << "Invalid practice hash" << std::endl;
     exit(1);
   }
@@ -29,14 +69,10 @@ uint64_t Interface::hash_to_board (const std::string& hash, Board& board_lut) {
   uint64_t tiles = 0;
   int i = 0;
 
+  // this gets called per request by the server, so no stringstreams
   for (int x = 0; x < 4; x++) {
     for (int y = 0; y < 4; y++) {
-      std::stringstream ss;
-      int tile;
-
-      ss << std::hex << hash[i];
-      ss >> tile;
-      tiles = board_lut.set_tile(tiles, x, y, tile);
+      tiles = board_lut.set_tile(tiles, x, y, hex_digit(hash[i]));
       i++;
     }
   }
@@ -51,7 +87,7 @@ void Interface::run_interface () {
 
   while (true) {
     std::cout
-      << "Do you want to create a new table (1), read an existing one (2), trainer mode (3), or quit (4)"
+      << "Do you want to create a new table (1), read an existing one (2), trainer mode (3), convert an old table (4), or quit (5)"
       << std::endl;
 
     int answer;
@@ -68,6 +104,9 @@ void Interface::run_interface () {
         trainer_mode();
         break;
       case 4:
+        convert_table();
+        break;
+      case 5:
         return;
       default:
         std::cerr
@@ -78,6 +117,168 @@ void Interface::run_interface () {
   }
 }
 
+int Interface::run_command (const std::vector<std::string>& args) {
+  if (args.size() >= 2 && args[0] == "serve") {
+    std::string socket_path;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool policy = false;
+
+    for (std::size_t i = 2; i < args.size(); i++) {
+      if (args[i] == "--socket" && i + 1 < args.size()) {
+        socket_path = args[++i];
+      } else if (args[i] == "--threads" && i + 1 < args.size()) {
+        if (!parse_number(args[++i], num_threads) || num_threads <= 0) {
+          std::cerr << "Invalid # threads " << args[i] << std::endl;
+          return usage();
+        }
+      } else if (args[i] == "--policy") {
+        policy = true;
+      } else {
+        std::cerr << "Unknown option " << args[i] << std::endl;
+        return 1;
+      }
+    }
+
+    return serve(args[1], socket_path, num_threads, policy);
+  }
+
+  if (args.size() == 2 && args[0] == "policy") {
+    return export_policy(args[1]);
+  }
+
+  if (args.size() >= 4 && args[0] == "plan") {
+    std::size_t sample_size = 200000;
+    uint64_t seed = 1;
+
+    for (std::size_t i = 4; i < args.size(); i++) {
+      if (args[i] == "--samples" && i + 1 < args.size()) {
+        if (!parse_number(args[++i], sample_size) || sample_size == 0) {
+          std::cerr << "Invalid # samples " << args[i] << std::endl;
+          return usage();
+        }
+      } else if (args[i] == "--seed" && i + 1 < args.size()) {
+        if (!parse_number(args[++i], seed)) {
+          std::cerr << "Invalid seed " << args[i] << std::endl;
+          return usage();
+        }
+      } else {
+        std::cerr << "Unknown option " << args[i] << std::endl;
+        return 1;
+      }
+    }
+
+    int goal_tile;
+    if (!parse_number(args[3], goal_tile)) {
+      std::cerr << "Invalid goal tile " << args[3] << std::endl;
+      return usage();
+    }
+
+    return plan(args[1], args[2], goal_tile, sample_size, seed);
+  }
+
+  return usage();
+}
+
+int Interface::plan (const std::string& start_hash, const std::string& static_hash, int goal_tile, std::size_t sample_size, uint64_t seed) {
+  if (!valid_hash(start_hash) || !valid_hash(static_hash)) {
+    std::cerr << "Invalid practice hash" << std::endl;
+    return 1;
+  }
+  if (goal_tile < 4 || (goal_tile & (goal_tile - 1)) != 0) {
+    std::cerr << "The goal tile has to be a power of 2" << std::endl;
+    return 1;
+  }
+
+  uint64_t starting_board = hash_to_board(start_hash, board_lut);
+  uint64_t static_tiles = hash_to_board(static_hash, board_lut);
+  int num_moving_tiles = __builtin_popcount(board_lut.get_empty_squares(static_tiles));
+
+  Planner planner(board_lut, starting_board, static_tiles, std::log2(goal_tile), sample_size, seed);
+  planner.report(std::cout, num_moving_tiles);
+  return 0;
+}
+
+int Interface::serve (const std::string& name, const std::string& socket_path, int num_threads, bool policy) {
+  // accept either the bare name like the prompts do or the directory itself
+  std::string dir = std::filesystem::exists(name + "/meta.txt"s) ? name : "table_"s + name;
+  if (!load_table(dir)) {
+    return 1;
+  }
+
+  try {
+    if (policy) {
+      table_generator->load_policy();
+    } else {
+      table_generator->load_all_tables();
+    }
+
+    TableServer server(*table_generator, board_lut, num_threads, policy);
+    if (socket_path.empty()) {
+      server.serve_stdio();
+    } else {
+      server.serve_socket(socket_path);
+    }
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+int Interface::export_policy (const std::string& name) {
+  std::string dir = std::filesystem::exists(name + "/meta.txt"s) ? name : "table_"s + name;
+  if (!load_table(dir)) {
+    return 1;
+  }
+
+  try {
+    std::string path = table_generator->export_policy();
+    PolicyFile policy(path);
+    std::cout
+      << "Wrote " << path << ", " << policy.num_boards() << " boards in " << policy.file_size() << " bytes ("
+      << (policy.num_boards() == 0 ? 0.0 : 8.0 * policy.file_size() / policy.num_boards()) << " bits a board)"
+      << std::endl;
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+bool Interface::load_table (const std::string& name, int num_threads) {
+  std::ifstream meta_file(name + "/meta.txt"s);
+  if (!meta_file.good()) {
+    std::cerr
+      << "Could not find table "s + name
+      << std::endl;
+    return false;
+  }
+
+  uint64_t starting_board, static_tiles;
+  int goal_tile;
+
+  meta_file >> starting_board;
+  meta_file >> static_tiles;
+  meta_file >> goal_tile;
+  table_generator = std::make_unique<TableGenerator>(board_lut, name, starting_board, static_tiles, goal_tile, 0, num_threads);
+  table_start = starting_board;
+
+  // older tables don't say, they have the old encoding
+  int precision;
+  if (!(meta_file >> precision)) {
+    precision = TableGenerator::LEGACY_PRECISION;
+  }
+  try {
+    table_generator->set_precision(precision);
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
 void Interface::read_table () {
   if (!table_generator) {
     std::cout
@@ -85,23 +286,9 @@ void Interface::read_table () {
       << std::endl;
     std::string name;
     std::cin >> name;
-    name = "table_"s + name;
-
-    std::ifstream meta_file(name + "/meta.txt"s);
-    if (!meta_file.good()) {
-      std::cerr
-        << "Could not find table "s + name
-        << std::endl;
+    if (!load_table("table_"s + name)) {
       return;
     }
-
-    uint64_t starting_board, static_tiles;
-    int goal_tile;
-
-    meta_file >> starting_board;
-    meta_file >> static_tiles;
-    meta_file >> goal_tile;
-    table_generator = std::make_unique<TableGenerator>(board_lut, name, starting_board, static_tiles, goal_tile, 0, 0);
   }
   
   std::string hash;
@@ -187,24 +374,44 @@ void Interface::trainer_mode () {
   }
 }
 
-void Interface::create_table () {
+void Interface::convert_table () {
   std::cout
     << "What's the name of the table?"
     << std::endl;
   std::string name;
   std::cin >> name;
-  name = "table_"s + name;
+  if (!load_table("table_"s + name)) {
+    return;
+  }
 
-  bool positions_generated = false;
+  try {
+    table_generator->convert_table();
+    std::cout << "Done converting" << std::endl;
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+  }
+}
 
+void Interface::create_table () {
   std::cout
-    << "Do you already have positions generated to evaluate (Y), or do you want to do both (N)?"
+    << "What's the name of the table?"
     << std::endl;
+  std::string name;
+  std::cin >> name;
+  name = "table_"s + name;
 
   char answer;
-  std::cin >> answer;
-  if (answer == 'Y' || answer == 'y') {
-    positions_generated = true;
+
+  TableGenerator::Progress progress;
+  if (TableGenerator::read_progress(name, progress) && progress.phase == "evaluate") {
+    std::cout
+      << "This table stopped while evaluating sum " << progress.tile_sum << ", do you want to resume it? (Y/N)"
+      << std::endl;
+    std::cin >> answer;
+    if (answer == 'Y' || answer == 'y') {
+      resume_table(name, progress);
+      return;
+    }
   }
 
   uint64_t starting_board;
@@ -263,12 +470,41 @@ void Interface::create_table () {
       << std::endl;
   }
 
-  int goal_tile;
-  std::cout
-    << "What's the goal tile?" << std::endl
-    << "Getting 2 of this tile is considered a win" << std::endl
-    << "Enter goal tile:" << std::endl;
-  std::cin >> goal_tile;
+  std::vector<int> goal_tiles;
+  while (goal_tiles.empty()) {
+    std::string goals;
+    std::cout
+      << "What's the goal tile?" << std::endl
+      << "Getting 2 of this tile is considered a win" << std::endl
+      << "Several like 64,128,256 make a table for each from the same positions, table_<name>_<goal>" << std::endl
+      << "Enter goal tile:" << std::endl;
+    std::cin >> goals;
+
+    std::stringstream goal_stream(goals);
+    std::string goal;
+    while (std::getline(goal_stream, goal, ',')) {
+      int goal_tile = std::atoi(goal.c_str());
+      if (goal_tile < 4 || (goal_tile & (goal_tile - 1)) != 0) {
+        std::cout << goal << " isn't a power of 2" << std::endl;
+        goal_tiles.clear();
+        break;
+      }
+      goal_tiles.push_back(goal_tile);
+    }
+
+    if (goal_tiles.size() > LayerStore::MAX_GOALS) {
+      std::cout << "At most " << LayerStore::MAX_GOALS << " goals at once" << std::endl;
+      goal_tiles.clear();
+    }
+  }
+
+  // the highest goal's table keeps the progress, so that's the one to resume
+  std::sort(goal_tiles.rbegin(), goal_tiles.rend());
+  goal_tiles.erase(std::unique(goal_tiles.begin(), goal_tiles.end()), goal_tiles.end());
+  std::vector<std::string> names;
+  for (int goal_tile : goal_tiles) {
+    names.push_back(goal_tiles.size() == 1 ? name : name + "_"s + std::to_string(goal_tile));
+  }
 
   int num_threads;
   std::cout
@@ -281,27 +517,97 @@ void Interface::create_table () {
     exit(0);
   }
 
-  uint64_t cache_size;
+  uint64_t expected_layer_size;
   std::cout
-    << "What do you want the cache size to be?" << std::endl
-    << "Ideally this should be a prime number, and a large one." << std::endl
-    << "If you're doing 10 space, a good size is 104,395,301" << std::endl
+    << "Roughly how many positions do you expect for one tile sum?" << std::endl
+    << "This is only where the duplicate checking starts, it grows if it's too small." << std::endl
+    << "If you're doing 10 space, a good size is 100,000,000" << std::endl
+    << "\"tables plan\" can guess it, along with how much memory and disk it needs" << std::endl
     << "Enter size:" << std::endl;
-  std::cin >> cache_size;
+  std::cin >> expected_layer_size;
 
-  std::cout << "Starting..." << std::endl;
+  double memory_gb;
+  std::cout
+    << "How much memory can it use, in GB?" << std::endl
+    << "Past that it keeps positions and lookahead on disk and evaluates in passes." << std::endl
+    << "Enter 0 to use half of this machine's memory:" << std::endl;
+  std::cin >> memory_gb;
 
-  std::ofstream meta_file(name + "/meta.txt"s);
-  meta_file
-    << starting_board << std::endl
-    << static_tiles << std::endl
-    << std::log2(goal_tile) << std::endl;
-  
-  table_generator = std::make_unique<TableGenerator>(board_lut, name, starting_board, static_tiles, std::log2(goal_tile), cache_size, num_threads);
+  int precision;
+  while (true) {
+    std::cout
+      << "How many bits should each probability get? (8, 12, 14 or 16)" << std::endl
+      << "Fewer makes smaller tables, " << TableGenerator::DEFAULT_PRECISION << " is what older tables had" << std::endl
+      << "Enter bits:" << std::endl;
+    std::cin >> precision;
+    if (precision != TableGenerator::LEGACY_PRECISION && TableGenerator::valid_precision(precision)) {
+      break;
+    }
+    std::cout << "Womp womp, try again" << std::endl;
+  }
+
+  std::cout
+    << "The positions are kept on disk in " << TableGenerator::positions_dir_for(starting_board, static_tiles, std::log2(goal_tiles[0])) << " after the table is done," << std::endl
+    << "so other tables with the same start and goal use them again. Delete it to get the space back." << std::endl
+    << "Starting..." << std::endl;
+
+  // the constructor and add_goal make the table directories, so this has to come after them
+  table_generator = std::make_unique<TableGenerator>(board_lut, names[0], starting_board, static_tiles, std::log2(goal_tiles[0]), expected_layer_size, num_threads);
+  table_generator->set_memory_budget(std::max(memory_gb, 0.0) * (1 << 30));
+  table_generator->set_precision(precision);
+  for (std::size_t i = 1; i < goal_tiles.size(); i++) {
+    table_generator->add_goal(std::log2(goal_tiles[i]), names[i]);
+  }
+
+  for (std::size_t i = 0; i < goal_tiles.size(); i++) {
+    std::ofstream meta_file(names[i] + "/meta.txt"s);
+    meta_file
+      << starting_board << std::endl
+      << static_tiles << std::endl
+      << std::log2(goal_tiles[i]) << std::endl
+      << precision << std::endl;
+  }
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  try {
+    table_generator->generate_table();
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    return;
+  }
+
+  auto end_time = std::chrono::high_resolution_clock::now();
+  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  std::cout << "Completed in " << (duration / 1e6) << " seconds." << std::endl;
+  for (std::size_t i = 1; i < names.size(); i++) {
+    std::cout << "The " << goal_tiles[i] << " table is in " << names[i] << std::endl;
+  }
+
+  print_probs(starting_board);
+}
+
+void Interface::resume_table (const std::string& name, const TableGenerator::Progress& progress) {
+  int num_threads;
+  std::cout
+    << "How many threads do you want to use?"
+    << std::endl;
+
+  std::cin >> num_threads;
+  if (num_threads < 1) {
+    std::cerr << "Invalid # threads" << std::endl;
+    return;
+  }
+
+  if (!load_table(name, num_threads)) {
+    return;
+  }
+  for (const auto& goal : progress.extra_goals) {
+    table_generator->add_goal(goal.first, goal.second);
+  }
 
   auto start_time = std::chrono::high_resolution_clock::now();
   try {
-    table_generator->generate_table(positions_generated);
+    table_generator->resume_table(progress);
   } catch (const std::runtime_error& ex) {
     std::cerr << ex.what() << std::endl;
     return;
@@ -311,9 +617,13 @@ void Interface::create_table () {
   auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
   std::cout << "Completed in " << (duration / 1e6) << " seconds." << std::endl;
 
+  print_probs(table_start);
+}
+
+void Interface::print_probs (uint64_t board) {
   MoveProbs p;
   try {
-    p = table_generator->read_table(starting_board);
+    p = table_generator->read_table(board);
     std::cout << "The probability of this position is" << std::endl
       << "U: " << p.probs[0]*100 << "%" << std::endl
       << "R: " << p.probs[1]*100 << "%" << std::endl
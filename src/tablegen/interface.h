@@ -3,6 +3,7 @@
 #include <iostream>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "table_generator.h"
 
@@ -10,14 +11,28 @@ class Interface {
 private:
   Board board_lut;
   std::unique_ptr<TableGenerator> table_generator;
+
+  uint64_t table_start = 0; // starting board of the last table loaded
+
+  bool load_table (const std::string& name, int num_threads = 0);
+  void resume_table (const std::string& name, const TableGenerator::Progress& progress);
+  void print_probs (uint64_t board);
 public:
   Interface () {}
 
   static std::string board_to_hash (uint64_t board, Board& board_lut);
   static uint64_t hash_to_board (const std::string& hash, Board& board_lut);
+  static bool valid_hash (const std::string& hash);
 
   void read_table ();
   void create_table ();
   void trainer_mode ();
+  void convert_table ();
   void run_interface ();
+
+  // non-interactive modes, args are everything after the program name
+  int run_command (const std::vector<std::string>& args);
+  int serve (const std::string& name, const std::string& socket_path, int num_threads, bool policy);
+  int export_policy (const std::string& name);
+  int plan (const std::string& start_hash, const std::string& static_hash, int goal_tile, std::size_t sample_size, uint64_t seed);
 };
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sys/mman.h>
+
+#include "layer_store.h"
+
+namespace {
+
+/**
+ * reserves count and asks for huge pages before anything touches them,
+ * finds land all over a big store and with 4k pages nearly every one
+ * walks the page table too. the kernel can say no, that's fine
+ */
+template <typename T>
+void reserve_huge (std::vector<T>& vec, std::size_t count) {
+  const uintptr_t HUGE_PAGE = 1 << 21;
+
+  vec.reserve(count);
+  uintptr_t begin = (reinterpret_cast<uintptr_t>(vec.data()) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(vec.data() + count) & ~(HUGE_PAGE - 1);
+  if (end > begin) {
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+  }
+}
+
+}
+
+LayerStore::LayerStore (std::vector<Entry>& entries, int num_moving_tiles, int num_goals): key_bits(num_moving_tiles * 4), num_goals(num_goals) {
+  if (num_goals < 1 || num_goals > MAX_GOALS) {
+    throw layer_store_error("Can't keep "s + std::to_string(num_goals) + " goals"s);
+  }
+
+  for (auto& entry : entries) {
+    entry.key = scramble(entry.key, key_bits);
+  }
+  std::sort(entries.begin(), entries.end());
+
+  reserve_huge(keys, entries.size());
+  reserve_huge(best, entries.size() * num_goals);
+  for (const auto& entry : entries) {
+    keys.push_back(entry.key);
+    best.insert(best.end(), entry.best.begin(), entry.best.begin() + num_goals);
+  }
+
+  make_fanout();
+}
+
+void LayerStore::make_fanout () {
+  // ~8 keys a bucket, so a find only touches one or two lines of keys, for a byte a key
+  fanout_bits = 0;
+  while (fanout_bits < key_bits && (keys.size() >> (fanout_bits + 3)) > 0) {
+    fanout_bits++;
+  }
+
+  std::size_t buckets = std::size_t(1) << fanout_bits;
+  fanout = std::vector<uint64_t>();
+  reserve_huge(fanout, buckets + 1);
+  fanout.assign(buckets + 1, keys.size());
+
+  std::size_t i = 0;
+  for (uint64_t bucket = 0; bucket + 1 < fanout.size(); bucket++) {
+    while (fanout_bits != 0 && i < keys.size() && (keys[i] >> (key_bits - fanout_bits)) < bucket) {
+      i++;
+    }
+    fanout[bucket] = i;
+  }
+}
+
+uint16_t LayerStore::quantize (float prob) {
+  return std::lround(std::clamp(prob, 0.0f, 1.0f) * 65535);
+}
+
+const uint16_t* LayerStore::find (uint64_t key) const {
+  if (keys.empty()) {
+    return nullptr;
+  }
+
+  key = scramble(key, key_bits);
+  uint64_t bucket = bucket_of(key);
+  auto first = keys.begin() + fanout[bucket];
+  auto last = keys.begin() + fanout[bucket + 1];
+
+  auto it = std::lower_bound(first, last, key);
+  if (it == last || *it != key) {
+    return nullptr;
+  }
+
+  return best.data() + (it - keys.begin()) * num_goals;
+}
+
+void LayerStore::save (const std::string& path) const {
+  uint64_t count = keys.size();
+  std::vector<uint64_t> slices(NUM_SLICES + 1, count);
+
+  std::size_t i = 0;
+  for (int slice = 0; slice < NUM_SLICES; slice++) {
+    while (i < keys.size() && slice_of_scrambled(keys[i], key_bits) < slice) {
+      i++;
+    }
+    slices[slice] = i;
+  }
+
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&count), sizeof count);
+  file.write(reinterpret_cast<const char*>(slices.data()), slices.size() * sizeof(uint64_t));
+  file.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(uint64_t));
+  file.write(reinterpret_cast<const char*>(best.data()), best.size() * sizeof(uint16_t));
+
+  if (!file.good()) {
+    throw layer_store_error("Failed writing "s + path);
+  }
+}
+
+LayerStore LayerStore::load (const std::string& path, int first_slice, int last_slice, int num_moving_tiles, int num_goals) {
+  std::ifstream file(path, std::ios::binary);
+
+  uint64_t count;
+  std::vector<uint64_t> slices(NUM_SLICES + 1);
+  file.read(reinterpret_cast<char*>(&count), sizeof count);
+  file.read(reinterpret_cast<char*>(slices.data()), slices.size() * sizeof(uint64_t));
+  if (!file.good()) {
+    throw layer_store_error("Could not read "s + path);
+  }
+
+  std::size_t header_size = sizeof count + slices.size() * sizeof(uint64_t);
+  uint64_t begin = slices[first_slice];
+  uint64_t end = slices[last_slice];
+
+  LayerStore store;
+  store.key_bits = num_moving_tiles * 4;
+  store.num_goals = num_goals;
+  reserve_huge(store.keys, end - begin);
+  reserve_huge(store.best, (end - begin) * num_goals);
+  store.keys.resize(end - begin);
+  store.best.resize((end - begin) * num_goals);
+
+  file.seekg(header_size + begin * sizeof(uint64_t));
+  file.read(reinterpret_cast<char*>(store.keys.data()), store.keys.size() * sizeof(uint64_t));
+  file.seekg(header_size + count * sizeof(uint64_t) + begin * num_goals * sizeof(uint16_t));
+  file.read(reinterpret_cast<char*>(store.best.data()), store.best.size() * sizeof(uint16_t));
+  if (!file.good()) {
+    throw layer_store_error("Could not read "s + path);
+  }
+
+  store.make_fanout();
+  return store;
+}
+
+std::vector<uint64_t> LayerStore::slice_sizes (const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+
+  uint64_t count;
+  std::vector<uint64_t> slices(NUM_SLICES + 1);
+  file.read(reinterpret_cast<char*>(&count), sizeof count);
+  file.read(reinterpret_cast<char*>(slices.data()), slices.size() * sizeof(uint64_t));
+  if (!file.good()) {
+    throw layer_store_error("Could not read "s + path);
+  }
+
+  std::vector<uint64_t> sizes(NUM_SLICES);
+  for (int slice = 0; slice < NUM_SLICES; slice++) {
+    sizes[slice] = slices[slice + 1] - slices[slice];
+  }
+  return sizes;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std::literals::string_literals;
+
+/**
+ * the best probability of every board in one partition of a layer, for
+ * looking ahead while evaluating the layers below it
+ *
+ * evaluating only ever wants probs[best_move] of the sum + 2 and
+ * sum + 4 layers, so that's all this keeps: boards packed with
+ * Board::pack_tiles in one sorted array, and next to them the probability
+ * rounded to 16 bits. that's 11 bytes a board with the fanout, a hash map of
+ * MoveProbs was ~40 with its overhead
+ *
+ * rounding is to the nearest 1/65535, well under the 14 bit table precision
+ *
+ * evaluating several goals at once, every board has the same key in all of
+ * them, so a store keeps num_goals probabilities per key (best[i *
+ * num_goals + goal]) and one search finds all of them
+ *
+ * keys are kept scrambled, put through a bijection of key_bits bits. packed
+ * boards share long prefixes (on an 8 space layer only 12 of the 64 top 6
+ * bit prefixes had any), scrambled ones spread evenly over the fanout
+ * buckets and the slices
+ *
+ * when the lookahead doesn't fit in memory, stores get saved as runs on
+ * disk and loaded back a range of slices at a time, a slice being the
+ * keys with the same top SLICE_BITS bits once scrambled. run files are
+ *   count       uint64
+ *   slices      (1 << SLICE_BITS) + 1 uint64, index of each slice's first key
+ *   keys        count uint64, scrambled and sorted
+ *   best        count * num_goals uint16
+ */
+class LayerStore {
+private:
+  // top key bits -> first index, same idea as the table file fanout
+  std::vector<uint64_t> fanout;
+  uint32_t fanout_bits = 0;
+  uint32_t key_bits = 0;
+  int num_goals = 1;
+
+  std::vector<uint64_t> keys;
+  std::vector<uint16_t> best;
+
+  void make_fanout ();
+
+  // of a scrambled key
+  uint64_t bucket_of (uint64_t key) const {
+    return fanout_bits == 0 ? 0 : key >> (key_bits - fanout_bits);
+  }
+
+  // two rounds of multiply and xorshift, each one invertible mod 2^key_bits
+  static uint64_t scramble (uint64_t key, uint32_t key_bits) {
+    uint64_t mask = key_bits >= 64 ? UINT64_MAX : (UINT64_C(1) << key_bits) - 1;
+    int shift = (key_bits + 1) / 2;
+    key = (key * UINT64_C(0x9E3779B97F4A7C15)) & mask;
+    key ^= key >> shift;
+    key = (key * UINT64_C(0xC4CEB9FE1A85EC53)) & mask;
+    key ^= key >> shift;
+    return key;
+  }
+
+  static int slice_of_scrambled (uint64_t key, uint32_t key_bits) {
+    return key_bits >= SLICE_BITS ? key >> (key_bits - SLICE_BITS) : key << (SLICE_BITS - key_bits);
+  }
+public:
+  static constexpr int SLICE_BITS = 8;
+  static constexpr int NUM_SLICES = 1 << SLICE_BITS;
+
+  // an Entry's padding has room for this many anyway
+  static const int MAX_GOALS = 4;
+
+  struct Entry {
+    uint64_t key; // output of Board::pack_tiles
+    std::array<uint16_t, MAX_GOALS> best; // only the first num_goals are used
+
+    bool operator< (const Entry& other) const {
+      return key < other.key;
+    }
+  };
+
+  struct layer_store_error: public std::runtime_error {
+    layer_store_error(const std::string& text): std::runtime_error("Layer Store Error: "s + text) {}
+  };
+
+  LayerStore () {}
+
+  // scrambles the keys of entries and sorts them, in place
+  LayerStore (std::vector<Entry>& entries, int num_moving_tiles, int num_goals = 1);
+
+  static uint16_t quantize (float prob);
+
+  static int slice_of (uint64_t key, int num_moving_tiles) {
+    return slice_of_scrambled(scramble(key, num_moving_tiles * 4), num_moving_tiles * 4);
+  }
+
+  void save (const std::string& path) const;
+
+  // just the slices in [first_slice, last_slice) of a saved run
+  static LayerStore load (const std::string& path, int first_slice, int last_slice, int num_moving_tiles, int num_goals = 1);
+
+  // how many keys each slice of a saved run has, without loading it
+  static std::vector<uint64_t> slice_sizes (const std::string& path);
+
+  // the board's num_goals quantized probabilities, nullptr if it isn't in the layer
+  const uint16_t* find (uint64_t key) const;
+
+  /**
+   * a find is two cache misses in a big store, the fanout and then the
+   * keys. looking up lots of keys, prefetch_bucket all of them, then
+   * prefetch_keys all of them, then find all of them, and the misses
+   * overlap instead of waiting on each other
+   */
+  void prefetch_bucket (uint64_t key) const {
+    if (!keys.empty()) {
+      __builtin_prefetch(fanout.data() + bucket_of(scramble(key, key_bits)));
+    }
+  }
+
+  // the key's bucket, both ends in case it crosses a line, and its probabilities
+  void prefetch_keys (uint64_t key) const {
+    if (!keys.empty()) {
+      uint64_t bucket = bucket_of(scramble(key, key_bits));
+      uint64_t first = fanout[bucket];
+      uint64_t last = fanout[bucket + 1];
+      __builtin_prefetch(keys.data() + first);
+      __builtin_prefetch(keys.data() + last - 1);
+      __builtin_prefetch(best.data() + first * num_goals);
+    }
+  }
+
+  // 0 for boards that aren't in the layer, the same as the old map lookup
+  float find_best (uint64_t key, int goal = 0) const {
+    const uint16_t* found = find(key);
+    return found == nullptr ? 0 : found[goal] / 65535.0f;
+  }
+
+  std::size_t size () const {
+    return keys.size();
+  }
+
+  std::size_t bytes () const {
+    return keys.size() * sizeof(uint64_t) + best.size() * sizeof(uint16_t) + fanout.size() * sizeof(uint64_t);
+  }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * row lookup tables, built by the compiler so there's nothing to load
+ *
+ * a row is 4 nibbles, the high nibble is x = 0, and each nibble is the
+ * log2 of the tile (0 for empty). "right" moves tiles towards the low
+ * nibble, "left" towards the high one
+ */
+namespace lut {
+
+struct RowMoves {
+  uint16_t right;
+  uint16_t left;
+};
+
+/**
+ * slides and merges a row, shift_of(n) is where the n'th tile from the
+ * wall goes. a merge just adds 1 to the nibble it lands on, so two
+ * 32768s make a 16 that spills into the next nibble over (or off the
+ * end). the old python generator did the same, and it's kept so tables
+ * stay the same
+ */
+template <typename ShiftOf>
+constexpr uint16_t slide_row (uint16_t row, bool towards_high, ShiftOf shift_of) {
+  uint32_t res = 0;
+  int n = 0;
+  int last = 0; // last tile placed, 0 if it already merged
+
+  for (int i = 0; i < 4; i++) {
+    int tile = (row >> (towards_high ? 12 - 4 * i : 4 * i)) & 0xF;
+    if (tile == 0) {
+      continue;
+    }
+
+    if (tile == last) {
+      res += UINT32_C(1) << shift_of(n - 1);
+      last = 0;
+    } else {
+      res += static_cast<uint32_t>(tile) << shift_of(n);
+      n++;
+      last = tile;
+    }
+  }
+
+  return static_cast<uint16_t>(res);
+}
+
+constexpr uint16_t move_row_left (uint16_t row) {
+  return slide_row(row, true, [](int n) { return 12 - 4 * n; });
+}
+
+constexpr uint16_t move_row_right (uint16_t row) {
+  return slide_row(row, false, [](int n) { return 4 * n; });
+}
+
+// bit i is set if x = i is empty
+constexpr uint16_t empty_in_row (uint16_t row) {
+  uint16_t empty = 0;
+  for (int x = 0; x < 4; x++) {
+    if (((row >> (12 - 4 * x)) & 0xF) == 0) {
+      empty |= 1 << x;
+    }
+  }
+  return empty;
+}
+
+/**
+ * compilers cap how much work one constant expression can do, and the
+ * whole move table is just over gcc's default, so it's built in quarters
+ * that each get their own budget
+ */
+constexpr std::array<RowMoves, 16384> make_move_lut_quarter (uint32_t quarter) {
+  std::array<RowMoves, 16384> moves = {};
+  for (uint32_t i = 0; i < 16384; i++) {
+    uint16_t row = quarter * 16384 + i;
+    moves[i] = {move_row_right(row), move_row_left(row)};
+  }
+  return moves;
+}
+
+constexpr std::array<RowMoves, 65536> join_move_lut (
+  const std::array<RowMoves, 16384>& q0,
+  const std::array<RowMoves, 16384>& q1,
+  const std::array<RowMoves, 16384>& q2,
+  const std::array<RowMoves, 16384>& q3
+) {
+  std::array<RowMoves, 65536> moves = {};
+  for (uint32_t i = 0; i < 16384; i++) {
+    moves[i] = q0[i];
+    moves[16384 + i] = q1[i];
+    moves[32768 + i] = q2[i];
+    moves[49152 + i] = q3[i];
+  }
+  return moves;
+}
+
+constexpr std::array<uint16_t, 65536> make_empty_lut () {
+  std::array<uint16_t, 65536> empty = {};
+  for (uint32_t row = 0; row < 65536; row++) {
+    empty[row] = empty_in_row(row);
+  }
+  return empty;
+}
+
+}
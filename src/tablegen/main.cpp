@@ -1,12 +1,19 @@
 #include <iostream>
 #include <array>
 #include <chrono>
+#include <string>
+#include <vector>
 #include "board.h"
 #include "table_generator.h"
 #include "interface.h"
 
-int main() {
+int main(int argc, char* argv[]) {
   Interface interface;
+
+  if (argc > 1) {
+    return interface.run_command(std::vector<std::string>(argv + 1, argv + argc));
+  }
+
   interface.run_interface();
 
   return 0;
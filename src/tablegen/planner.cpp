@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "planner.h"
+#include "table_generator.h"
+
+Planner::Planner (Board& board_lut, uint64_t root, uint64_t static_tiles, uint8_t goal_tile, std::size_t sample_size, uint64_t seed): board_lut(board_lut), root(root), static_tiles(static_tiles), goal_tile(goal_tile), sample_size(std::max<std::size_t>(sample_size, 2)), rng(seed) {
+  static_tiles_mask = board_lut.make_static_tiles_mask(static_tiles);
+}
+
+void Planner::expand (int sum) {
+  const Layer& layer = layers[sum];
+  Captures& plus_two = captures[sum + 2];
+  Captures& plus_four = captures[sum + 4];
+
+  for (uint64_t board : layer.sample) {
+    // the same boards the generator doesn't expand
+    if (board_lut.game_over(board) || board_lut.num_tiles(board, goal_tile) > 1) {
+      continue;
+    }
+
+    bool first_half = rng() & 1;
+    for (Direction dir : {Direction::up, Direction::right, Direction::down, Direction::left}) {
+      uint64_t moved_board = board_lut.move(board, dir);
+      if (moved_board == board || (moved_board & static_tiles_mask) != static_tiles) {
+        continue;
+      }
+
+      for (int pos = 0; pos < 16; pos++) {
+        if (Board::get_tile(moved_board, pos) != 0) {
+          continue;
+        }
+        uint64_t two = Board::set_tile(moved_board, pos % 4, pos / 4, 1);
+        uint64_t four = Board::set_tile(moved_board, pos % 4, pos / 4, 2);
+        (first_half ? plus_two.first : plus_two.second).push_back(two);
+        (first_half ? plus_four.first : plus_four.second).push_back(four);
+      }
+    }
+  }
+}
+
+static void sort_unique (std::vector<uint64_t>& boards) {
+  std::sort(boards.begin(), boards.end());
+  boards.erase(std::unique(boards.begin(), boards.end()), boards.end());
+}
+
+std::vector<Planner::LayerEstimate> Planner::estimate_layers () {
+  layers.clear();
+  captures.clear();
+
+  int sum = board_lut.sum_of_tiles(root);
+  Layer& first = layers[sum];
+  first.sample.push_back(root);
+  first.positions = 1;
+
+  std::vector<LayerEstimate> estimates;
+  while (layers.count(sum) != 0 && layers[sum].positions > 0) {
+    estimates.push_back({sum, layers[sum].positions, layers[sum].exact});
+    expand(sum);
+
+    // sum + 2 has now heard from both of its parent layers
+    int next = sum + 2;
+    Captures caught = std::move(captures[next]);
+    captures.erase(next);
+    sort_unique(caught.first);
+    sort_unique(caught.second);
+
+    std::vector<uint64_t> reached;
+    std::set_union(
+      caught.first.begin(), caught.first.end(),
+      caught.second.begin(), caught.second.end(),
+      std::back_inserter(reached)
+    );
+
+    bool parents_complete = true;
+    for (int parent : {sum, sum - 2}) {
+      auto it = layers.find(parent);
+      if (it != layers.end() && !it->second.complete) {
+        parents_complete = false;
+      }
+    }
+
+    Layer& layer = layers[next];
+    layer.exact = parents_complete;
+    if (parents_complete) {
+      layer.positions = reached.size();
+    } else {
+      std::vector<uint64_t> both;
+      std::set_intersection(
+        caught.first.begin(), caught.first.end(),
+        caught.second.begin(), caught.second.end(),
+        std::back_inserter(both)
+      );
+      double a = caught.first.size();
+      double b = caught.second.size();
+      layer.positions = (a + 1) * (b + 1) / (both.size() + 1) - 1;
+    }
+
+    layer.complete = parents_complete && reached.size() <= sample_size;
+    if (reached.size() > sample_size) {
+      std::shuffle(reached.begin(), reached.end(), rng);
+      reached.resize(sample_size);
+    }
+    layer.sample = std::move(reached);
+
+    // only the two layers below the next one are ever needed again
+    layers.erase(sum - 2);
+    sum = next;
+  }
+
+  return estimates;
+}
+
+static std::string format_bytes (double bytes) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  if (bytes >= (1ull << 30)) {
+    out << bytes / (1ull << 30) << " GB";
+  } else if (bytes >= (1ull << 20)) {
+    out << bytes / (1ull << 20) << " MB";
+  } else {
+    out << bytes / (1ull << 10) << " KB";
+  }
+  return out.str();
+}
+
+void Planner::report (std::ostream& out, int num_moving_tiles) {
+  std::vector<LayerEstimate> estimates = estimate_layers();
+
+  // rough per board costs of the generator, see table_generator.cpp
+  const double POSITION_BYTES = sizeof(uint64_t);
+  const double SET_BYTES = 20; // ankerl set entry at its usual load factor
+  const double EVALUATE_BYTES = 48; // table entry, lookahead entry, encoded entry
+  const double LOOKAHEAD_BYTES = 10;
+  const double POSITIONS_PER_THREAD = 50000;
+
+  const double TABLE_PROB_BITS = 32; // coded probs and the block index, see table_file.h
+
+  // positions/ is Rice coded (see position_file.h) a shard at a time, about log2 of the gap between keys + 2 bits a board
+  auto compressed_bytes = [&](double layer_positions) {
+    if (layer_positions < 1) {
+      return 0.0;
+    }
+    double gap_bits = 4 * num_moving_tiles - std::log2(layer_positions / TableGenerator::NUM_SHARDS);
+    return layer_positions * (std::max(gap_bits, 0.0) + 2) / 8;
+  };
+
+  std::map<int, double> positions;
+  double total = 0;
+  LayerEstimate largest = {0, 0, true};
+  bool any_estimated = false;
+
+  out << "Predicted positions per tile sum (~ is an estimate):" << std::endl;
+  for (const auto& estimate : estimates) {
+    positions[estimate.sum] = estimate.positions;
+    total += estimate.positions;
+    if (estimate.positions > largest.positions) {
+      largest = estimate;
+    }
+    any_estimated |= !estimate.exact;
+
+    out
+      << "  " << std::setw(6) << estimate.sum << "  " << (estimate.exact ? " " : "~")
+      << std::fixed << std::setprecision(0) << estimate.positions << std::endl;
+  }
+
+  auto at = [&positions](int sum) {
+    auto it = positions.find(sum);
+    return it == positions.end() ? 0.0 : it->second;
+  };
+
+  double generate_peak = 0;
+  double evaluate_peak = 0;
+  double positions_disk = 0;
+  double table_disk = 0;
+  for (const auto& estimate : estimates) {
+    int sum = estimate.sum;
+    positions_disk += compressed_bytes(estimate.positions);
+    table_disk += compressed_bytes(estimate.positions) + estimate.positions * TABLE_PROB_BITS / 8;
+    double next = at(sum + 2) + at(sum + 4);
+    generate_peak = std::max(generate_peak, (estimate.positions + next) * POSITION_BYTES + next * SET_BYTES);
+    evaluate_peak = std::max(evaluate_peak, estimate.positions * EVALUATE_BYTES + next * LOOKAHEAD_BYTES);
+  }
+
+  unsigned hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+  int threads = std::clamp<int>(std::ceil(largest.positions / POSITIONS_PER_THREAD), 1, hardware_threads);
+
+  out
+    << std::endl
+    << "Layers: " << estimates.size() << std::endl
+    << "Total positions: " << (any_estimated ? "~" : "") << std::fixed << std::setprecision(0) << total << std::endl
+    << "Largest layer: " << largest.positions << " at sum " << largest.sum << std::endl
+    << "positions/ on disk: " << format_bytes(positions_disk) << std::endl
+    << "Table on disk: " << format_bytes(table_disk) << std::endl
+    << "Peak memory generating: " << format_bytes(generate_peak) << std::endl
+    << "Peak memory evaluating: " << format_bytes(evaluate_peak) << std::endl
+    << "Keeping every layer in memory: " << format_bytes(total * POSITION_BYTES) << " more" << std::endl
+    << std::endl
+    << "Expected layer size to enter: " << static_cast<uint64_t>(largest.positions) << std::endl
+    << "Threads: " << threads << " (of " << hardware_threads << ")" << std::endl;
+  out << std::defaultfloat;
+
+  if (any_estimated) {
+    out << "Sampling kicked in, so the sizes are estimates, and likely a bit low" << std::endl;
+  }
+}
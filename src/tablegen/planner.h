@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <random>
+#include <cstdint>
+#include <ostream>
+
+#include "board.h"
+
+/**
+ * guesses how big a table is going to be without building it
+ *
+ * it walks the layers like the generator does, but only ever keeps a
+ * sample of at most sample_size boards of each layer. while every parent
+ * of a layer was kept, the layer's size is exact. after that each
+ * layer's sampled parents get split in two halves, the boards each half
+ * reaches are two captures, and the size is the capture-recapture
+ * (Chapman) estimate from how many boards both halves reached
+ *
+ * boards with lots of parents get caught more often, so the estimates
+ * lean low once sampling kicks in
+ */
+class Planner {
+private:
+  struct Layer {
+    std::vector<uint64_t> sample;
+    double positions = 0;
+    bool complete = true; // sample is the whole layer
+    bool exact = true; // positions is a count, not an estimate
+  };
+
+  // boards reached from one half of a layer's sample
+  struct Captures {
+    std::vector<uint64_t> first;
+    std::vector<uint64_t> second;
+  };
+
+  Board& board_lut;
+  uint64_t root;
+  uint64_t static_tiles;
+  uint64_t static_tiles_mask;
+  uint8_t goal_tile;
+  std::size_t sample_size;
+  std::mt19937_64 rng;
+
+  std::map<int, Layer> layers;
+  std::map<int, Captures> captures;
+
+  void expand (int sum);
+public:
+  Planner (Board& board_lut, uint64_t root, uint64_t static_tiles, uint8_t goal_tile, std::size_t sample_size, uint64_t seed);
+
+  struct LayerEstimate {
+    int sum;
+    double positions;
+    bool exact;
+  };
+
+  std::vector<LayerEstimate> estimate_layers ();
+
+  // layer sizes plus what they mean for memory, disk and the settings to use
+  void report (std::ostream& out, int num_moving_tiles);
+};
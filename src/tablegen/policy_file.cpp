@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "policy_file.h"
+
+constexpr char PolicyFile::MAGIC[8];
+
+// murmur3's finalizer
+static uint64_t mix (uint64_t key, uint64_t seed) {
+  uint64_t h = key + seed * UINT64_C(0x9E3779B97F4A7C15);
+  h ^= h >> 33;
+  h *= UINT64_C(0xFF51AFD7ED558CCD);
+  h ^= h >> 33;
+  h *= UINT64_C(0xC4CEB9FE1A85EC53);
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t rotate_left (uint64_t x, int n) {
+  return (x << n) | (x >> (64 - n));
+}
+
+static uint8_t get_cell (const uint8_t* cells, uint64_t i) {
+  return (cells[i >> 2] >> ((i & 3) * 2)) & 3;
+}
+
+void PolicyFile::cells_of (uint64_t key, uint64_t seed, uint64_t block_length, uint64_t cells[3]) {
+  uint64_t h = mix(key, seed);
+  for (int i = 0; i < 3; i++) {
+    // the top of a 32 x 32 bit product maps the hash onto [0, block_length) without a division
+    uint64_t part = rotate_left(h, 21 * i) & 0xFFFFFFFF;
+    cells[i] = ((part * block_length) >> 32) + i * block_length;
+  }
+}
+
+PolicyFile::EncodedLayer PolicyFile::encode_layer (int sum, const std::vector<uint64_t>& keys, const std::vector<uint8_t>& moves) {
+  EncodedLayer layer;
+  layer.sum = sum;
+  layer.num_boards = keys.size();
+  layer.block_length = (keys.size() * 123 / 100 + 32 + 2) / 3;
+  uint64_t num_cells = 3 * layer.block_length;
+
+  std::vector<uint32_t> counts(num_cells);
+  std::vector<uint64_t> key_xors(num_cells); // xor of the indices of the keys in each cell
+  std::vector<uint64_t> queue;
+  std::vector<std::pair<uint64_t, uint64_t>> peeled; // key index, the cell it's solved with
+  peeled.reserve(keys.size());
+
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+    layer.seed = attempt;
+    std::fill(counts.begin(), counts.end(), 0);
+    std::fill(key_xors.begin(), key_xors.end(), 0);
+    queue.clear();
+    peeled.clear();
+
+    uint64_t cells[3];
+    for (uint64_t i = 0; i < keys.size(); i++) {
+      cells_of(keys[i], layer.seed, layer.block_length, cells);
+      for (uint64_t cell : cells) {
+        counts[cell]++;
+        key_xors[cell] ^= i;
+      }
+    }
+
+    // a cell with one key left decides that key, take it out of its other cells and repeat
+    for (uint64_t cell = 0; cell < num_cells; cell++) {
+      if (counts[cell] == 1) {
+        queue.push_back(cell);
+      }
+    }
+    while (!queue.empty()) {
+      uint64_t cell = queue.back();
+      queue.pop_back();
+      if (counts[cell] != 1) {
+        continue;
+      }
+
+      uint64_t i = key_xors[cell];
+      peeled.push_back({i, cell});
+      cells_of(keys[i], layer.seed, layer.block_length, cells);
+      for (uint64_t other : cells) {
+        counts[other]--;
+        key_xors[other] ^= i;
+        if (counts[other] == 1) {
+          queue.push_back(other);
+        }
+      }
+    }
+
+    if (peeled.size() != keys.size()) {
+      continue;
+    }
+
+    // backwards, so the other two cells of a key are final by the time it's set
+    layer.cells.assign((num_cells + 3) / 4, 0);
+    for (auto it = peeled.rbegin(); it != peeled.rend(); it++) {
+      cells_of(keys[it->first], layer.seed, layer.block_length, cells);
+      uint8_t value = moves[it->first];
+      for (uint64_t other : cells) {
+        if (other != it->second) {
+          value ^= get_cell(layer.cells.data(), other);
+        }
+      }
+      layer.cells[it->second >> 2] |= value << ((it->second & 3) * 2);
+    }
+
+    layer.cells.resize((layer.cells.size() + 7) / 8 * 8, 0);
+    return layer;
+  }
+
+  throw policy_file_error("Could not build the policy of layer "s + std::to_string(sum));
+}
+
+void PolicyFile::write (const std::string& path, const std::vector<EncodedLayer>& layers) {
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+  header.version = VERSION;
+  header.num_layers = layers.size();
+
+  std::vector<LayerInfo> directory;
+  uint64_t offset = sizeof(Header) + layers.size() * sizeof(LayerInfo);
+  for (const auto& layer : layers) {
+    directory.push_back({layer.sum, 0, layer.seed, layer.block_length, layer.num_boards, offset});
+    offset += layer.cells.size();
+    header.num_boards += layer.num_boards;
+  }
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file.good()) {
+    throw policy_file_error("Could not write "s + path);
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof header);
+  file.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(LayerInfo));
+  for (const auto& layer : layers) {
+    file.write(reinterpret_cast<const char*>(layer.cells.data()), layer.cells.size());
+  }
+
+  if (!file.good()) {
+    throw policy_file_error("Failed writing "s + path);
+  }
+}
+
+PolicyFile::PolicyFile (const std::string& path): path(path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw policy_file_error("Could not open "s + path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    throw policy_file_error(path + " is too small to be a policy file"s);
+  }
+  size = st.st_size;
+
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw policy_file_error("Could not mmap "s + path);
+  }
+  data = static_cast<const char*>(mapped);
+
+  std::memcpy(&header, data, sizeof header);
+  if (std::memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.version != VERSION) {
+    munmap(const_cast<char*>(data), size);
+    throw policy_file_error(path + " isn't a policy file this version can read"s);
+  }
+  if (sizeof(Header) + header.num_layers * sizeof(LayerInfo) > size) {
+    munmap(const_cast<char*>(data), size);
+    throw policy_file_error(path + " is truncated"s);
+  }
+
+  const LayerInfo* directory = reinterpret_cast<const LayerInfo*>(data + sizeof(Header));
+  for (uint32_t i = 0; i < header.num_layers; i++) {
+    const LayerInfo& info = directory[i];
+    if (info.offset > size || size - info.offset < (3 * info.block_length + 3) / 4) {
+      munmap(const_cast<char*>(data), size);
+      throw policy_file_error(path + " is truncated"s);
+    }
+    layers[info.sum] = {info.seed, info.block_length, reinterpret_cast<const uint8_t*>(data + info.offset)};
+  }
+
+  // lookups jump around, readahead just wastes page cache
+  madvise(const_cast<char*>(data), size, MADV_RANDOM);
+}
+
+PolicyFile::~PolicyFile () {
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+  }
+}
+
+bool PolicyFile::find (int sum, uint64_t key, uint8_t& move) const {
+  auto it = layers.find(sum);
+  if (it == layers.end()) {
+    return false;
+  }
+
+  const Layer& layer = it->second;
+  uint64_t cells[3];
+  cells_of(key, layer.seed, layer.block_length, cells);
+  move = get_cell(layer.cells, cells[0]) ^ get_cell(layer.cells, cells[1]) ^ get_cell(layer.cells, cells[2]);
+  return true;
+}
+
+void PolicyFile::preload () const {
+  madvise(const_cast<char*>(data), size, MADV_WILLNEED);
+
+  volatile char sink = 0;
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (std::size_t i = 0; i < size; i += page_size) {
+    sink += data[i];
+  }
+  (void) sink;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std::literals::string_literals;
+
+/**
+ * <table>/policy.bin, just the best move of every board in a table, made
+ * by TableGenerator::export_policy and memory mapped
+ *
+ * a layer isn't a list of keys, it's a static function from its keys to
+ * their moves, the xor kind: 3 hashes of a key pick a cell in each third
+ * of an array of 2 bit cells, and the xor of those 3 is the move. there's
+ * 1.23 cells a key (about 2.5 bits), found by peeling like xor filters do.
+ * a board that isn't in the layer gets a move too, just a meaningless one,
+ * so it's only for boards the table has
+ *
+ * layout (all little endian):
+ *   header      magic, version, # layers, # boards
+ *   directory   sum, seed, cells per third, # boards and offset per layer
+ *   cells       4 per byte, lowest bits first, each layer padded to 8 bytes
+ */
+class PolicyFile {
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_layers;
+    uint64_t num_boards;
+  };
+
+  struct LayerInfo {
+    int32_t sum;
+    uint32_t reserved;
+    uint64_t seed;
+    uint64_t block_length;
+    uint64_t num_boards;
+    uint64_t offset;
+  };
+
+  struct Layer {
+    uint64_t seed;
+    uint64_t block_length;
+    const uint8_t* cells;
+  };
+
+  static constexpr char MAGIC[8] = {'2', '0', '4', '8', 'P', 'O', 'L', '\n'};
+  static const uint32_t VERSION = 1;
+  static const int MAX_ATTEMPTS = 64;
+
+  std::string path;
+
+  const char* data = nullptr;
+  std::size_t size = 0;
+
+  Header header;
+  std::map<int, Layer> layers;
+
+  // the 3 cells of a key, one in each third
+  static void cells_of (uint64_t key, uint64_t seed, uint64_t block_length, uint64_t cells[3]);
+public:
+  PolicyFile (const std::string& path);
+  ~PolicyFile ();
+
+  PolicyFile (const PolicyFile& other) = delete;
+  PolicyFile& operator=(const PolicyFile& other) = delete;
+
+  struct policy_file_error: public std::runtime_error {
+    policy_file_error(const std::string& text): std::runtime_error("Policy File Error: "s + text) {}
+  };
+
+  // a layer ready to be written, see encode_layer
+  struct EncodedLayer {
+    int sum = 0;
+    uint64_t seed = 0;
+    uint64_t block_length = 0;
+    uint64_t num_boards = 0;
+    std::vector<uint8_t> cells;
+  };
+
+  // keys are from Board::pack_tiles and unique, moves[i] is the best move of keys[i]
+  static EncodedLayer encode_layer (int sum, const std::vector<uint64_t>& keys, const std::vector<uint8_t>& moves);
+  static void write (const std::string& path, const std::vector<EncodedLayer>& layers);
+
+  std::size_t num_boards () const {
+    return header.num_boards;
+  }
+
+  std::size_t file_size () const {
+    return size;
+  }
+
+  // the best move (up right down left) of the board with key in layer sum, false if there's no such layer
+  bool find (int sum, uint64_t key, uint8_t& move) const;
+
+  // faults every page in now instead of on the first lookups
+  void preload () const;
+};
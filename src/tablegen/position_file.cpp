@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "position_file.h"
+#include "bit_stream.h"
+
+constexpr char PositionFile::MAGIC[8];
+
+namespace {
+
+// what Rice coding the gaps in [begin, end) costs with this k, in bits
+uint64_t block_bits (const std::vector<uint64_t>& keys, std::size_t begin, std::size_t end, int k) {
+  uint64_t bits = 0;
+  for (std::size_t i = begin + 1; i < end; i++) {
+    bits += rice_bits(keys[i] - keys[i - 1] - 1, k);
+  }
+  return bits;
+}
+
+void put_uint64 (std::vector<char>& out, uint64_t value) {
+  const char* bytes = reinterpret_cast<const char*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof value);
+}
+
+}
+
+PositionFile::EncodedSegment PositionFile::encode_segment (std::vector<uint64_t>& keys) {
+  std::sort(keys.begin(), keys.end());
+
+  std::vector<uint64_t> offsets;
+  std::vector<char> blocks;
+  for (std::size_t begin = 0; begin < keys.size(); begin += BLOCK_SIZE) {
+    std::size_t end = std::min(begin + BLOCK_SIZE, keys.size());
+    offsets.push_back(blocks.size());
+
+    /**
+     * k around log2 of the average gap is about right, but which side of
+     * it is best depends on how the gaps spread, so just try both. the
+     * decoder reads the low bits in one go, so it can't be more than 56
+     */
+    int k = 0;
+    if (end - begin > 1) {
+      uint64_t average = (keys[end - 1] - keys[begin]) / (end - begin - 1);
+      k = rice_parameter(average);
+      if (k > 0 && block_bits(keys, begin, end, k - 1) < block_bits(keys, begin, end, k)) {
+        k--;
+      }
+    }
+
+    put_uint64(blocks, keys[begin]);
+    blocks.push_back(static_cast<char>(k));
+
+    BitWriter writer(blocks);
+    for (std::size_t i = begin + 1; i < end; i++) {
+      writer.put_rice(keys[i] - keys[i - 1] - 1, k);
+    }
+    writer.flush();
+  }
+  offsets.push_back(blocks.size());
+
+  EncodedSegment segment;
+  segment.num_boards = keys.size();
+  segment.num_blocks = offsets.size() - 1;
+  for (uint64_t offset : offsets) {
+    put_uint64(segment.data, offset);
+  }
+  segment.data.insert(segment.data.end(), blocks.begin(), blocks.end());
+  return segment;
+}
+
+std::vector<char> PositionFile::encode_header (const std::vector<EncodedSegment>& segments) {
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+  header.version = VERSION;
+  header.num_segments = segments.size();
+
+  std::vector<SegmentInfo> directory;
+  uint64_t offset = sizeof(Header) + segments.size() * sizeof(SegmentInfo);
+  for (const auto& segment : segments) {
+    directory.push_back({offset, segment.num_boards, segment.num_blocks});
+    offset += segment.data.size();
+    header.num_boards += segment.num_boards;
+    header.num_blocks += segment.num_blocks;
+  }
+
+  std::vector<char> data(reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header) + sizeof header);
+  data.insert(data.end(), reinterpret_cast<const char*>(directory.data()), reinterpret_cast<const char*>(directory.data() + directory.size()));
+  return data;
+}
+
+PositionFile::PositionFile (const std::string& path): path(path) {
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw position_file_error("Could not open "s + path);
+  }
+
+  if (pread(fd, &header, sizeof header, 0) != sizeof header) {
+    close(fd);
+    throw position_file_error("Could not read "s + path);
+  }
+  if (std::memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.version != VERSION) {
+    close(fd);
+    throw position_file_error(path + " isn't a positions file this version can read"s);
+  }
+
+  std::vector<SegmentInfo> directory(header.num_segments);
+  ssize_t directory_size = directory.size() * sizeof(SegmentInfo);
+  if (pread(fd, directory.data(), directory_size, sizeof header) != directory_size) {
+    close(fd);
+    throw position_file_error("Could not read "s + path);
+  }
+
+  // the offsets are 8 bytes every BLOCK_SIZE boards, they're all kept
+  for (const SegmentInfo& info : directory) {
+    Segment segment;
+    segment.num_boards = info.num_boards;
+    segment.offsets.resize(info.num_blocks + 1);
+    ssize_t offsets_size = segment.offsets.size() * sizeof(uint64_t);
+    if (pread(fd, segment.offsets.data(), offsets_size, info.offset) != offsets_size) {
+      close(fd);
+      throw position_file_error("Could not read "s + path);
+    }
+    segment.blocks_start = info.offset + offsets_size;
+    segments.push_back(std::move(segment));
+  }
+}
+
+PositionFile::~PositionFile () {
+  close(fd);
+}
+
+void PositionFile::read_block (int segment_index, std::size_t block, std::vector<char>& buffer, uint64_t* keys) const {
+  const Segment& segment = segments[segment_index];
+
+  // padded, so the reader can always load a whole word
+  std::size_t size = segment.offsets[block + 1] - segment.offsets[block];
+  buffer.assign(size + sizeof(uint64_t), 0);
+  if (pread(fd, buffer.data(), size, segment.blocks_start + segment.offsets[block]) != static_cast<ssize_t>(size)) {
+    throw position_file_error("Failed reading "s + path);
+  }
+
+  std::size_t count = std::min<uint64_t>(BLOCK_SIZE, segment.num_boards - block * BLOCK_SIZE);
+  std::memcpy(&keys[0], buffer.data(), sizeof(uint64_t));
+  int k = static_cast<unsigned char>(buffer[sizeof(uint64_t)]);
+
+  BitReader reader(buffer.data() + sizeof(uint64_t) + 1);
+  for (std::size_t i = 1; i < count; i++) {
+    keys[i] = keys[i - 1] + reader.get_rice(k) + 1;
+  }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std::literals::string_literals;
+
+/**
+ * one layer in positions/, compressed, every shard in a segment of its own
+ *
+ * the boards are packed with Board::pack_tiles, sorted, and cut into
+ * blocks of BLOCK_SIZE. a block keeps its first key as is, and the gaps
+ * between the rest Rice coded: gap - 1 split into gap >> k in unary and the
+ * low k bits, k picked per block from its average gap. that's about
+ * k + 2 bits a board, where the raw boards were 64
+ *
+ * blocks are read back one at a time, so evaluating only ever holds the
+ * chunk it's working on. layout (all little endian):
+ *   header      magic, version, # segments, # boards, # blocks
+ *   directory   offset, # boards and # blocks of each segment
+ *   segments    one per shard, each one is
+ *     offsets   # blocks + 1 uint64, where each block starts after them
+ *     blocks    first key uint64, k uint8, then the bits, LSB first
+ *
+ * version 1 files were a single shard, with no directory
+ */
+class PositionFile {
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_segments;
+    uint64_t num_boards;
+    uint64_t num_blocks;
+  };
+
+  struct SegmentInfo {
+    uint64_t offset;
+    uint64_t num_boards;
+    uint64_t num_blocks;
+  };
+
+  struct Segment {
+    uint64_t num_boards;
+    uint64_t blocks_start;
+    std::vector<uint64_t> offsets;
+  };
+
+  static constexpr char MAGIC[8] = {'2', '0', '4', '8', 'P', 'O', 'S', '\n'};
+  static const uint32_t VERSION = 2;
+
+  std::string path;
+  int fd = -1;
+
+  Header header;
+  std::vector<Segment> segments;
+public:
+  static const std::size_t BLOCK_SIZE = 1024;
+
+  PositionFile (const std::string& path);
+  ~PositionFile ();
+
+  PositionFile (const PositionFile& other) = delete;
+  PositionFile& operator=(const PositionFile& other) = delete;
+
+  struct position_file_error: public std::runtime_error {
+    position_file_error(const std::string& text): std::runtime_error("Position File Error: "s + text) {}
+  };
+
+  // a segment ready to be written, see encode_segment
+  struct EncodedSegment {
+    std::vector<char> data;
+    uint64_t num_boards = 0;
+    uint64_t num_blocks = 0;
+  };
+
+  // sorts keys in place, they have to be unique. safe to call from several threads at once
+  static EncodedSegment encode_segment (std::vector<uint64_t>& keys);
+
+  // the header and directory, the segments' data goes right after it in the same order
+  static std::vector<char> encode_header (const std::vector<EncodedSegment>& segments);
+
+  std::size_t size () const {
+    return header.num_boards;
+  }
+
+  int num_segments () const {
+    return segments.size();
+  }
+
+  std::size_t segment_size (int segment) const {
+    return segments[segment].num_boards;
+  }
+
+  // the keys of one block, in order, safe to call from several threads at once
+  void read_block (int segment, std::size_t block, std::vector<char>& buffer, uint64_t* keys) const;
+};
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "position_writer.h"
+#include "board.h"
+
+PositionWriter::PositionWriter (int num_threads, uint64_t pack_mask): pack_mask(pack_mask) {
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back(&PositionWriter::thread_loop, this);
+  }
+}
+
+PositionWriter::~PositionWriter () {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void PositionWriter::write (const std::string& path, int shard, int num_shards, std::shared_ptr<std::vector<uint64_t>> positions) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<Layer>& layer = layers[path];
+    if (!layer) {
+      layer = std::make_shared<Layer>();
+      layer->path = path;
+      layer->segments.resize(num_shards);
+      layer->left = num_shards;
+    }
+    jobs.push_back({layer, shard, std::move(positions)});
+  }
+  cv.notify_one();
+}
+
+std::shared_ptr<std::vector<uint64_t>> PositionWriter::buffer () {
+  std::unique_ptr<std::vector<uint64_t>> buffer;
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (!pool->free.empty()) {
+      buffer = std::move(pool->free.back());
+      pool->free.pop_back();
+    }
+  }
+  if (!buffer) {
+    buffer = std::make_unique<std::vector<uint64_t>>();
+  }
+
+  std::shared_ptr<BufferPool> buffer_pool = pool;
+  return std::shared_ptr<std::vector<uint64_t>>(buffer.release(), [buffer_pool](std::vector<uint64_t>* buffer) {
+    buffer->resize(0); // keeps the capacity
+    std::lock_guard<std::mutex> lock(buffer_pool->mutex);
+    buffer_pool->free.emplace_back(buffer);
+  });
+}
+
+void PositionWriter::wait () {
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [this] { return jobs.empty() && in_progress == 0; });
+
+  if (!error.empty()) {
+    throw position_writer_error(error);
+  }
+}
+
+void PositionWriter::thread_loop () {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+      in_progress++;
+    }
+
+    encode_shard(job);
+    job.positions.reset();
+
+    // the last shard in writes the layer, it's still in progress until then
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      last = --job.layer->left == 0;
+      if (last) {
+        layers.erase(job.layer->path);
+      }
+    }
+    if (last) {
+      write_file(*job.layer);
+    }
+    job.layer.reset();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      in_progress--;
+    }
+    done_cv.notify_all();
+  }
+}
+
+void PositionWriter::encode_shard (const Job& job) {
+  std::vector<uint64_t> keys;
+  keys.reserve(job.positions->size());
+  for (uint64_t board : *job.positions) {
+    keys.push_back(Board::pack_tiles(board, pack_mask));
+  }
+
+  // every job has its own shard, so no lock
+  job.layer->segments[job.shard] = PositionFile::encode_segment(keys);
+}
+
+void PositionWriter::write_file (const Layer& layer) {
+  int fd = open(layer.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = "Could not open "s + layer.path;
+    return;
+  }
+
+  std::vector<char> header = PositionFile::encode_header(layer.segments);
+  std::vector<const std::vector<char>*> parts = {&header};
+  for (const auto& segment : layer.segments) {
+    parts.push_back(&segment.data);
+  }
+
+  for (const std::vector<char>* part : parts) {
+    const char* data = part->data();
+    std::size_t left = part->size();
+    while (left > 0) {
+      ssize_t written = ::write(fd, data, std::min(left, WRITE_CHUNK));
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = "Failed writing "s + layer.path;
+        close(fd);
+        return;
+      }
+      data += written;
+      left -= written;
+      bytes_written += written;
+    }
+  }
+
+  close(fd);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+
+#include "position_file.h"
+
+using namespace std::literals::string_literals;
+
+/**
+ * writes position layers to disk in the background, so generation can
+ * carry on expanding while a layer is being flushed. packing, sorting and
+ * compressing them (see PositionFile) happens on the writer's threads too
+ *
+ * every shard of a layer is its own job, so the threads share the layer.
+ * they go in one file, which gets written by whichever thread finishes the
+ * last shard, the others are held compressed until then
+ *
+ * a layer handed to write() must not change until it's been written, the
+ * writer keeps a reference to it until then. buffers from buffer() go back
+ * into a pool once the last reference is gone and get handed out again, so
+ * the generator isn't reallocating a layer's worth of memory every time
+ */
+class PositionWriter {
+private:
+  // big enough that the disk does the work, not the syscalls
+  static const std::size_t WRITE_CHUNK = std::size_t(8) << 20;
+
+  // a layer with shards still to come
+  struct Layer {
+    std::string path;
+    std::vector<PositionFile::EncodedSegment> segments;
+    int left;
+  };
+
+  struct Job {
+    std::shared_ptr<Layer> layer;
+    int shard;
+    std::shared_ptr<std::vector<uint64_t>> positions;
+  };
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable done_cv;
+  std::deque<Job> jobs;
+  std::map<std::string, std::shared_ptr<Layer>> layers; // by path
+  int in_progress = 0;
+  bool stopping = false;
+  std::string error;
+
+  // shared with the buffers it hands out, they go back in when they're dropped
+  struct BufferPool {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::vector<uint64_t>>> free;
+  };
+  std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>();
+
+  uint64_t pack_mask;
+  std::atomic<uint64_t> bytes_written{0};
+
+  void thread_loop ();
+  void encode_shard (const Job& job);
+  void write_file (const Layer& layer);
+public:
+  // pack_mask is from Board::make_pack_mask
+  PositionWriter (int num_threads, uint64_t pack_mask);
+  ~PositionWriter ();
+
+  PositionWriter (const PositionWriter& other) = delete;
+  PositionWriter& operator=(const PositionWriter& other) = delete;
+
+  struct position_writer_error: public std::runtime_error {
+    position_writer_error(const std::string& text): std::runtime_error("Position Writer Error: "s + text) {}
+  };
+
+  // one shard of the layer at path, the file is written once all num_shards are in
+  void write (const std::string& path, int shard, int num_shards, std::shared_ptr<std::vector<uint64_t>> positions);
+
+  // an empty buffer, recycled if there's one free, safe to outlive the writer
+  std::shared_ptr<std::vector<uint64_t>> buffer ();
+
+  // blocks until everything queued is on disk, throws if a write failed
+  void wait ();
+
+  uint64_t total_bytes_written () const {
+    return bytes_written.load();
+  }
+};
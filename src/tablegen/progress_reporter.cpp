@@ -0,0 +1,128 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <ctime>
+
+#include "progress_reporter.h"
+
+ProgressReporter::ProgressReporter (const std::string& status_path, double interval_seconds): status_path(status_path), interval(static_cast<int64_t>(interval_seconds * 1000)) {
+  run_start = clock::now();
+  phase_start = run_start;
+  thread = std::thread(&ProgressReporter::thread_loop, this);
+}
+
+ProgressReporter::~ProgressReporter () {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  thread.join();
+
+  // the status file should say it's finished, not show the last layer
+  std::lock_guard<std::mutex> lock(mutex);
+  phase = "done";
+  report(false);
+}
+
+void ProgressReporter::start_layer (const std::string& phase, int tile_sum, uint64_t layer_total, uint64_t work_after) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (phase != this->phase) {
+    this->phase = phase;
+    phase_start = clock::now();
+    phase_done_before_layer = 0;
+    previous_layer_total = 0;
+  } else {
+    phase_done_before_layer += done.load();
+    previous_layer_total = this->layer_total;
+  }
+
+  this->tile_sum = tile_sum;
+  this->layer_total = layer_total;
+  this->work_after = work_after;
+  done = 0;
+}
+
+void ProgressReporter::thread_loop () {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+    if (!phase.empty()) {
+      report(true);
+    }
+  }
+}
+
+static std::string format_seconds (double seconds) {
+  if (seconds < 0) {
+    return "?";
+  }
+
+  std::ostringstream out;
+  uint64_t s = seconds;
+  if (s >= 3600) {
+    out << s / 3600 << "h" << std::setw(2) << std::setfill('0') << (s % 3600) / 60 << "m";
+  } else if (s >= 60) {
+    out << s / 60 << "m" << std::setw(2) << std::setfill('0') << s % 60 << "s";
+  } else {
+    out << s << "s";
+  }
+  return out.str();
+}
+
+void ProgressReporter::report (bool to_stderr) {
+  clock::time_point now = clock::now();
+  double elapsed = std::chrono::duration<double>(now - run_start).count();
+  double phase_seconds = std::chrono::duration<double>(now - phase_start).count();
+
+  uint64_t layer_done = std::min(done.load(), layer_total);
+  double percent = layer_total == 0 ? 100.0 : 100.0 * layer_done / layer_total;
+  double rate = phase_seconds > 0 ? (phase_done_before_layer + layer_done) / phase_seconds : 0;
+
+  double layer_eta = rate > 0 ? (layer_total - layer_done) / rate : -1;
+  double eta = rate > 0 && work_after != 0 ? (layer_total - layer_done + work_after) / rate : -1;
+  if (phase == "evaluate" && work_after == 0) {
+    eta = layer_eta; // the last layer
+  }
+
+  // layers grow about as much as the last one did, at least for a while
+  uint64_t next_layer_estimate = 0;
+  if (phase == "generate" && previous_layer_total != 0) {
+    next_layer_estimate = static_cast<double>(layer_total) * layer_total / previous_layer_total;
+  }
+
+  if (to_stderr) {
+    std::cerr
+      << "[" << format_seconds(elapsed) << "] " << phase << " sum " << tile_sum << ": "
+      << std::fixed << std::setprecision(1) << percent << "% of " << layer_total << " boards, "
+      << std::setprecision(0) << rate << " boards/s, layer ETA " << format_seconds(layer_eta);
+    if (eta >= 0 && phase != "generate") {
+      std::cerr << ", ETA " << format_seconds(eta);
+    }
+    if (next_layer_estimate != 0) {
+      std::cerr << ", next layer ~" << next_layer_estimate << " boards";
+    }
+    std::cerr << std::defaultfloat << std::endl;
+  }
+
+  std::string tmp_path = status_path + ".tmp";
+  {
+    std::ofstream file(tmp_path);
+    file
+      << "{\"phase\": \"" << phase << "\""
+      << ", \"tile_sum\": " << tile_sum
+      << ", \"layer_done\": " << layer_done
+      << ", \"layer_total\": " << layer_total
+      << ", \"percent\": " << percent
+      << ", \"boards_per_second\": " << rate
+      << ", \"layer_eta_seconds\": " << layer_eta
+      << ", \"eta_seconds\": " << eta
+      << ", \"next_layer_estimate\": " << next_layer_estimate
+      << ", \"elapsed_seconds\": " << elapsed
+      << ", \"updated\": " << std::time(nullptr)
+      << "}" << std::endl;
+  }
+  std::rename(tmp_path.c_str(), status_path.c_str());
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * prints how far along a table run is every few seconds, to stderr and to
+ * <table>/status.json for anything polling it
+ *
+ * workers only ever bump an atomic counter once per chunk, everything else
+ * is done on the reporter's own thread. start_layer() is called between
+ * layers, from a barrier, with how many boards the layer has and how many
+ * are still to come after it in this phase (0 when that isn't known yet,
+ * like while generating)
+ *
+ * the rate is boards per second over the whole phase so far, the ETAs
+ * are what's left divided by that, or -1 when there's nothing to go on.
+ * generating has no overall ETA since nobody knows how many layers are
+ * left, but the next layer's size is guessed from how much the last grew
+ */
+class ProgressReporter {
+private:
+  using clock = std::chrono::steady_clock;
+
+  std::string status_path;
+  std::chrono::milliseconds interval;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+
+  // everything below is guarded by mutex, except done
+  std::string phase;
+  int tile_sum = 0;
+  uint64_t layer_total = 0;
+  uint64_t work_after = 0;
+  uint64_t previous_layer_total = 0;
+  uint64_t phase_done_before_layer = 0;
+  clock::time_point run_start;
+  clock::time_point phase_start;
+
+  std::atomic<uint64_t> done{0}; // boards done in the current layer
+
+  void thread_loop ();
+  void report (bool to_stderr);
+public:
+  ProgressReporter (const std::string& status_path, double interval_seconds);
+  ~ProgressReporter ();
+
+  ProgressReporter (const ProgressReporter& other) = delete;
+  ProgressReporter& operator=(const ProgressReporter& other) = delete;
+
+  void start_layer (const std::string& phase, int tile_sum, uint64_t layer_total, uint64_t work_after);
+
+  void add (uint64_t boards) {
+    done.fetch_add(boards, std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "interface.h"
+
+TableServer::TableServer (TableGenerator& table_generator, Board& board_lut, int num_threads, bool policy): table_generator(table_generator), board_lut(board_lut), policy(policy) {
+  // a client hanging up shouldn't take the whole server down
+  std::signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < num_threads; i++) {
+    workers.emplace_back(&TableServer::worker_loop, this);
+  }
+}
+
+TableServer::~TableServer () {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void TableServer::worker_loop () {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    job();
+  }
+}
+
+void TableServer::answer (const std::string& request, std::string& out) {
+  out += request;
+
+  if (!Interface::valid_hash(request)) {
+    out += " error invalid practice hash\n";
+    return;
+  }
+
+  try {
+    if (policy) {
+      char line[4] = {' ', "URDL"[table_generator.read_policy(Interface::hash_to_board(request, board_lut))], '\n', 0};
+      out += line;
+      return;
+    }
+
+    MoveProbs p = table_generator.read_table(Interface::hash_to_board(request, board_lut));
+
+    char line[64];
+    std::snprintf(
+      line, sizeof line, " %.6f %.6f %.6f %.6f %c\n",
+      p.probs[0], p.probs[1], p.probs[2], p.probs[3], "URDL"[p.best_move]
+    );
+    out += line;
+  } catch (const std::runtime_error& ex) {
+    out += " error "s + ex.what() + "\n"s;
+  }
+}
+
+void TableServer::answer_batch (const std::vector<std::string>& requests, std::string& out) {
+  if (requests.size() <= CHUNK_SIZE || workers.empty()) {
+    for (const auto& request : requests) {
+      answer(request, out);
+    }
+    return;
+  }
+
+  std::size_t num_chunks = (requests.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::vector<std::string> results(num_chunks);
+
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  std::size_t remaining = num_chunks;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t chunk = 0; chunk < num_chunks; chunk++) {
+      jobs.emplace_back([&, chunk] {
+        std::size_t end = std::min(requests.size(), (chunk + 1) * CHUNK_SIZE);
+        for (std::size_t i = chunk * CHUNK_SIZE; i < end; i++) {
+          answer(requests[i], results[chunk]);
+        }
+
+        std::lock_guard<std::mutex> done_lock(done_mutex);
+        if (--remaining == 0) {
+          done_cv.notify_one();
+        }
+      });
+    }
+  }
+  cv.notify_all();
+
+  std::unique_lock<std::mutex> done_lock(done_mutex);
+  done_cv.wait(done_lock, [&] { return remaining == 0; });
+
+  for (const auto& result : results) {
+    out += result;
+  }
+}
+
+void TableServer::serve_fd (int in_fd, int out_fd) {
+  std::string pending;
+  std::vector<std::string> requests;
+  std::string out;
+  char buffer[1 << 16];
+
+  while (true) {
+    ssize_t n = read(in_fd, buffer, sizeof buffer);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    bool eof = n <= 0;
+    if (!eof) {
+      pending.append(buffer, n);
+    }
+
+    // everything that's fully arrived is one batch
+    std::size_t start = 0;
+    while (true) {
+      std::size_t end = pending.find('\n', start);
+      if (end == std::string::npos) {
+        if (eof && start < pending.size()) {
+          end = pending.size();
+        } else {
+          break;
+        }
+      }
+
+      std::size_t len = end - start;
+      if (len > 0 && pending[end - 1] == '\r') {
+        len--;
+      }
+      if (len > 0) {
+        requests.emplace_back(pending, start, len);
+      }
+      start = end + 1;
+    }
+    pending.erase(0, std::min(start, pending.size()));
+
+    if (!requests.empty()) {
+      out.clear();
+      answer_batch(requests, out);
+      requests.clear();
+
+      const char* data = out.data();
+      std::size_t left = out.size();
+      while (left > 0) {
+        ssize_t written = write(out_fd, data, left);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          return;
+        }
+        data += written;
+        left -= written;
+      }
+    }
+
+    if (eof) {
+      return;
+    }
+  }
+}
+
+void TableServer::serve_stdio () {
+  serve_fd(STDIN_FILENO, STDOUT_FILENO);
+}
+
+void TableServer::serve_socket (const std::string& path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    throw server_error("Socket path is too long: "s + path);
+  }
+  std::strcpy(addr.sun_path, path.c_str());
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    throw server_error("Could not create socket"s);
+  }
+
+  unlink(path.c_str());
+  if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || listen(listen_fd, 64) != 0) {
+    close(listen_fd);
+    throw server_error("Could not listen on "s + path);
+  }
+
+  std::cerr << "Listening on " << path << std::endl;
+
+  while (true) {
+    int conn_fd = accept(listen_fd, nullptr, nullptr);
+    if (conn_fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      close(listen_fd);
+      throw server_error("accept failed"s);
+    }
+
+    // one reader per connection, lookups still go through the shared pool
+    std::thread([this, conn_fd] {
+      serve_fd(conn_fd, conn_fd);
+      close(conn_fd);
+    }).detach();
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "board.h"
+#include "table_generator.h"
+
+/**
+ * answers lookups for one table without the interactive prompts
+ *
+ * the protocol is line based, each request is a practice hash and each
+ * answer is one line in the same order:
+ *   <hash> <U> <R> <D> <L> <best move>
+ *   <hash> error <message>
+ * serving the table's policy (see TableGenerator::export_policy) instead,
+ * answers are only <hash> <best move>
+ * clients can send as many requests as they want before reading, whatever
+ * has arrived is answered as one batch spread over the worker pool
+ */
+class TableServer {
+private:
+  // below this a batch isn't worth handing to the pool
+  static const std::size_t CHUNK_SIZE = 256;
+
+  TableGenerator& table_generator;
+  Board& board_lut;
+  bool policy;
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> jobs;
+  bool stopping = false;
+
+  void worker_loop ();
+  void answer (const std::string& request, std::string& out);
+  void answer_batch (const std::vector<std::string>& requests, std::string& out);
+  void serve_fd (int in_fd, int out_fd);
+public:
+  TableServer (TableGenerator& table_generator, Board& board_lut, int num_threads, bool policy = false);
+  ~TableServer ();
+
+  TableServer (const TableServer& other) = delete;
+  TableServer& operator=(const TableServer& other) = delete;
+
+  struct server_error: public std::runtime_error {
+    server_error(const std::string& text): std::runtime_error("Server Error: "s + text) {}
+  };
+
+  void serve_stdio ();
+  void serve_socket (const std::string& path);
+};
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "table_file.h"
+#include "bit_stream.h"
+
+constexpr char TableFile::MAGIC[8];
+
+static int key_bytes_for (int num_moving_tiles) {
+  return (num_moving_tiles / 2) + (num_moving_tiles % 2 != 0);
+}
+
+// one direction of pack_probs at 1, and all four
+static uint64_t direction_one (int prob_bits) {
+  return (UINT64_C(1) << prob_bits) - 1;
+}
+
+static uint64_t all_one (int prob_bits) {
+  return prob_bits == 16 ? UINT64_MAX : (UINT64_C(1) << (4 * prob_bits)) - 1;
+}
+
+// what each direction of a row is, a base 3 digit of its pattern
+enum DirectionClass { ZERO = 0, ONE = 1, VALUE = 2 };
+
+// how many directions of a row have their bits written, by its first 8 bits
+static constexpr std::array<uint8_t, 256> make_row_values () {
+  std::array<uint8_t, 256> values = {};
+  for (int first = 1; first < 256; first += 2) {
+    for (int i = 0, rest = first >> 1; i < 4; i++, rest /= 3) {
+      values[first] += rest % 3 == VALUE;
+    }
+  }
+  return values;
+}
+static constexpr std::array<uint8_t, 256> ROW_VALUES = make_row_values();
+
+static void put_probs (BitWriter& writer, uint64_t probs, int prob_bits) {
+  uint64_t one = direction_one(prob_bits);
+  if (probs == 0) {
+    writer.put(0b00, 2);
+    return;
+  }
+  if (probs == all_one(prob_bits)) {
+    writer.put(0b10, 2);
+    return;
+  }
+
+  int pattern = 0;
+  for (int i = 3; i >= 0; i--) {
+    uint64_t part = (probs >> (prob_bits * i)) & one;
+    pattern = pattern * 3 + (part == 0 ? ZERO : part == one ? ONE : VALUE);
+  }
+  writer.put((pattern << 1) | 1, 8);
+
+  for (int i = 0; i < 4; i++) {
+    uint64_t part = (probs >> (prob_bits * i)) & one;
+    if (part != 0 && part != one) {
+      writer.put(part, prob_bits);
+    }
+  }
+}
+
+void TableFile::skip_probs (BitReader& reader) const {
+  reader.position += row_bits[reader.peek() & 0xFF];
+}
+
+uint64_t TableFile::get_probs (BitReader& reader) const {
+  uint64_t one = direction_one(prob_bits);
+  uint64_t bits = reader.get(8);
+  if ((bits & 1) == 0) {
+    reader.position -= 6;
+    return (bits & 2) ? all_one(prob_bits) : 0;
+  }
+
+  uint64_t probs = 0;
+  int pattern = bits >> 1;
+  for (int i = 0; i < 4; i++, pattern /= 3) {
+    uint64_t part = 0;
+    switch (pattern % 3) {
+      case ONE: part = one; break;
+      case VALUE: part = reader.get(prob_bits); break;
+    }
+    probs |= part << (prob_bits * i);
+  }
+  return probs;
+}
+
+TableFile::TableFile (const std::string& path): path(path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw table_file_error("Could not open "s + path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw table_file_error("Could not read "s + path);
+  }
+
+  // old format files have no header, so a near empty layer can be smaller than one
+  char magic[sizeof MAGIC];
+  if (static_cast<std::size_t>(st.st_size) >= sizeof magic && (pread(fd, magic, sizeof magic, 0) != sizeof magic || std::memcmp(magic, MAGIC, sizeof MAGIC) != 0)) {
+    close(fd);
+    throw table_file_error(path + " is in the old format, convert the table first"s);
+  }
+  if (static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    throw table_file_error(path + " is too small to be a table file"s);
+  }
+  size = st.st_size;
+
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw table_file_error("Could not mmap "s + path);
+  }
+  data = static_cast<const char*>(mapped);
+
+  std::memcpy(&header, data, sizeof header);
+  if (header.version < 1 || header.version > VERSION || header.key_bytes > 8 || header.prob_bytes > 8) {
+    munmap(const_cast<char*>(data), size);
+    throw table_file_error(path + " has an unsupported header"s);
+  }
+  entry_size = header.key_bytes + header.prob_bytes;
+
+  // the 4 directions of the probs fill prob_bytes exactly
+  prob_bits = header.prob_bytes * 2;
+  if (header.version >= 3 && prob_bits != 8 && prob_bits != 12 && prob_bits != 14 && prob_bits != 16) {
+    munmap(const_cast<char*>(data), size);
+    throw table_file_error(path + " has an unsupported header"s);
+  }
+  for (int first = 0; first < 256; first++) {
+    row_bits[first] = (first & 1) ? 8 + prob_bits * ROW_VALUES[first] : 2;
+  }
+
+  try {
+    if (header.version == 1) {
+      load_segment(sizeof(Header), header.num_entries, header.fanout_bits);
+    } else {
+      if (header.num_segments == 0 || sizeof(Header) + header.num_segments * sizeof(SegmentInfo) > size) {
+        throw table_file_error(path + " is truncated"s);
+      }
+
+      const SegmentInfo* directory = reinterpret_cast<const SegmentInfo*>(data + sizeof(Header));
+      for (uint32_t i = 0; i < header.num_segments; i++) {
+        if (header.version == 2) {
+          load_segment(directory[i].offset, directory[i].num_entries, directory[i].fanout_bits);
+        } else {
+          load_block_segment(directory[i].offset, directory[i].num_entries);
+        }
+      }
+    }
+  } catch (const table_file_error&) {
+    munmap(const_cast<char*>(data), size);
+    throw;
+  }
+
+  // lookups jump around, readahead just wastes page cache
+  madvise(const_cast<char*>(data), size, MADV_RANDOM);
+}
+
+void TableFile::load_segment (uint64_t offset, uint64_t num_entries, uint32_t fanout_bits) {
+  if (fanout_bits > 32) {
+    throw table_file_error(path + " has an unsupported header"s);
+  }
+
+  std::size_t fanout_size = ((std::size_t(1) << fanout_bits) + 1) * sizeof(uint64_t);
+  if (offset > size || size - offset < fanout_size + num_entries * entry_size) {
+    throw table_file_error(path + " is truncated"s);
+  }
+
+  Segment segment = {};
+  segment.fanout = reinterpret_cast<const uint64_t*>(data + offset);
+  segment.entries = data + offset + fanout_size;
+  segment.num_entries = num_entries;
+  segment.fanout_bits = fanout_bits;
+  segments.push_back(segment);
+}
+
+void TableFile::load_block_segment (uint64_t offset, uint64_t num_entries) {
+  uint64_t num_blocks = (num_entries + BLOCK_ENTRIES - 1) / BLOCK_ENTRIES;
+  std::size_t index_size = (num_blocks + 1) * sizeof(BlockIndex);
+  if (offset > size || size - offset < index_size) {
+    throw table_file_error(path + " is truncated"s);
+  }
+
+  Segment segment = {};
+  segment.num_entries = num_entries;
+  segment.num_blocks = num_blocks;
+  segment.index = reinterpret_cast<const BlockIndex*>(data + offset);
+  segment.blocks = data + offset + index_size;
+
+  // the padding at the end of the file has to be there too
+  if (size - offset - index_size < segment.index[num_blocks].offset + sizeof(uint64_t)) {
+    throw table_file_error(path + " is truncated"s);
+  }
+  segments.push_back(segment);
+}
+
+TableFile::~TableFile () {
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+  }
+}
+
+uint64_t TableFile::key_at (const Segment& segment, std::size_t i) const {
+  uint64_t key = 0;
+  std::memcpy(&key, segment.entries + i * entry_size, header.key_bytes);
+  return key;
+}
+
+void TableFile::segment_entries (int segment_index, std::vector<TableEntry>& entries) const {
+  const Segment& segment = segments[segment_index];
+  entries.resize(segment.num_entries);
+
+  if (header.version < 3) {
+    for (std::size_t i = 0; i < segment.num_entries; i++) {
+      entries[i].key = key_at(segment, i);
+      entries[i].probs = 0;
+      std::memcpy(&entries[i].probs, segment.entries + i * entry_size + header.key_bytes, header.prob_bytes);
+    }
+    return;
+  }
+
+  for (uint64_t block = 0; block < segment.num_blocks; block++) {
+    BitReader reader(segment.blocks + segment.index[block].offset);
+    int k = reader.get(6);
+
+    std::size_t begin = block * BLOCK_ENTRIES;
+    std::size_t end = std::min<std::size_t>(begin + BLOCK_ENTRIES, segment.num_entries);
+    for (std::size_t i = begin; i < end; i++) {
+      entries[i].key = i == begin ? segment.index[block].first_key : entries[i - 1].key + reader.get_rice(k) + 1;
+      entries[i].probs = get_probs(reader);
+    }
+  }
+}
+
+bool TableFile::find_in_blocks (const Segment& segment, uint64_t key, uint64_t& probs) const {
+  // the last block starting at or before key
+  const BlockIndex* at = std::lower_bound(segment.index, segment.index + segment.num_blocks, key);
+  if (at == segment.index + segment.num_blocks || at->first_key != key) {
+    if (at == segment.index) {
+      return false;
+    }
+    at--;
+  }
+  uint64_t block = at - segment.index;
+
+  BitReader reader(segment.blocks + at->offset);
+  int k = reader.get(6);
+
+  uint64_t current = at->first_key;
+  std::size_t count = std::min<uint64_t>(BLOCK_ENTRIES, segment.num_entries - block * BLOCK_ENTRIES);
+  for (std::size_t i = 0; i < count; i++) {
+    if (i != 0) {
+      current += reader.get_rice(k) + 1;
+    }
+    if (current > key) {
+      return false;
+    }
+
+    if (current == key) {
+      probs = get_probs(reader);
+      return true;
+    }
+    skip_probs(reader);
+  }
+
+  return false;
+}
+
+bool TableFile::find (int segment_index, uint64_t key, uint64_t& probs) const {
+  const Segment& segment = segments[segment_index];
+  if (header.version >= 3) {
+    return find_in_blocks(segment, key, probs);
+  }
+
+  uint64_t bucket = segment.fanout_bits == 0 ? 0 : key >> (header.key_bits - segment.fanout_bits);
+  if (bucket >= (UINT64_C(1) << segment.fanout_bits)) {
+    return false;
+  }
+
+  // plain binary search, buckets are small
+  std::size_t lo = segment.fanout[bucket];
+  std::size_t hi = segment.fanout[bucket + 1];
+  while (lo < hi) {
+    std::size_t mid = lo + (hi - lo) / 2;
+    uint64_t mid_key = key_at(segment, mid);
+    if (mid_key < key) {
+      lo = mid + 1;
+    } else if (mid_key > key) {
+      hi = mid;
+    } else {
+      probs = 0;
+      std::memcpy(&probs, segment.entries + mid * entry_size + header.key_bytes, header.prob_bytes);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void TableFile::preload () const {
+  madvise(const_cast<char*>(data), size, MADV_WILLNEED);
+
+  volatile char sink = 0;
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (std::size_t i = 0; i < size; i += page_size) {
+    sink += data[i];
+  }
+  (void) sink;
+}
+
+TableFile::EncodedSegment TableFile::encode_segment (std::vector<TableEntry>& entries, int prob_bits) {
+  std::sort(entries.begin(), entries.end());
+
+  EncodedSegment segment;
+  segment.num_entries = entries.size();
+
+  std::vector<BlockIndex> index;
+  std::vector<char> blocks;
+  for (std::size_t begin = 0; begin < entries.size(); begin += BLOCK_ENTRIES) {
+    std::size_t end = std::min<std::size_t>(begin + BLOCK_ENTRIES, entries.size());
+    index.push_back({entries[begin].key, blocks.size()});
+
+    // same as PositionFile, log2 of the average gap or one less
+    auto gap_bits = [&entries, begin, end](int k) {
+      uint64_t bits = 0;
+      for (std::size_t i = begin + 1; i < end; i++) {
+        bits += rice_bits(entries[i].key - entries[i - 1].key - 1, k);
+      }
+      return bits;
+    };
+    int k = 0;
+    if (end - begin > 1) {
+      k = rice_parameter((entries[end - 1].key - entries[begin].key) / (end - begin - 1));
+      if (k > 0 && gap_bits(k - 1) < gap_bits(k)) {
+        k--;
+      }
+    }
+
+    BitWriter writer(blocks);
+    writer.put(k, 6);
+    for (std::size_t i = begin; i < end; i++) {
+      if (i != begin) {
+        writer.put_rice(entries[i].key - entries[i - 1].key - 1, k);
+      }
+      put_probs(writer, entries[i].probs, prob_bits);
+    }
+    writer.flush();
+  }
+  index.push_back({UINT64_MAX, blocks.size()});
+
+  // keeps the next segment's index aligned
+  blocks.resize((blocks.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t), 0);
+
+  std::size_t index_size = index.size() * sizeof(BlockIndex);
+  segment.data.resize(index_size + blocks.size());
+  std::memcpy(segment.data.data(), index.data(), index_size);
+  std::memcpy(segment.data.data() + index_size, blocks.data(), blocks.size());
+
+  return segment;
+}
+
+void TableFile::write (const std::string& path, const std::vector<EncodedSegment>& segments, int num_moving_tiles, int prob_bits) {
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+  header.version = VERSION;
+  header.key_bits = num_moving_tiles * 4;
+  header.key_bytes = key_bytes_for(num_moving_tiles);
+  header.prob_bytes = prob_bits / 2;
+  header.num_segments = segments.size();
+
+  std::vector<SegmentInfo> directory;
+  uint64_t offset = sizeof(Header) + segments.size() * sizeof(SegmentInfo);
+  for (const auto& segment : segments) {
+    directory.push_back({offset, segment.num_entries, 0, 0});
+    offset += segment.data.size();
+    header.num_entries += segment.num_entries;
+  }
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file.good()) {
+    throw table_file_error("Could not write "s + path);
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof header);
+  file.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(SegmentInfo));
+  for (const auto& segment : segments) {
+    file.write(segment.data.data(), segment.data.size());
+  }
+  const char padding[sizeof(uint64_t)] = {};
+  file.write(padding, sizeof padding);
+
+  if (!file.good()) {
+    throw table_file_error("Failed writing "s + path);
+  }
+}
+
+bool TableFile::is_legacy (const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  Header header = {};
+  file.read(reinterpret_cast<char*>(&header), sizeof header);
+  return !file.good() || std::memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.version != VERSION;
+}
+
+void TableFile::convert_legacy (const std::string& path, int num_moving_tiles) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.good()) {
+    throw table_file_error("Could not open "s + path);
+  }
+
+  std::vector<EncodedSegment> segments;
+  int prob_bits = PROB_BYTES * 2;
+
+  char magic[sizeof MAGIC] = {};
+  file.read(magic, sizeof magic);
+  if (file.good() && std::memcmp(magic, MAGIC, sizeof MAGIC) == 0) {
+    // an older version, the segments stay the same
+    file.close();
+    TableFile old(path);
+    prob_bits = old.prob_bits;
+    std::vector<TableEntry> entries;
+    for (int segment = 0; segment < old.num_segments(); segment++) {
+      old.segment_entries(segment, entries);
+      segments.emplace_back(encode_segment(entries, prob_bits));
+    }
+  } else {
+    // no header, just the entries
+    file.clear();
+    file.seekg(0);
+
+    int key_bytes = key_bytes_for(num_moving_tiles);
+    std::vector<TableEntry> entries;
+    while (true) {
+      TableEntry entry = {0, 0};
+      if (!file.read(reinterpret_cast<char*>(&entry.key), key_bytes)) {
+        break;
+      }
+      if (!file.read(reinterpret_cast<char*>(&entry.probs), PROB_BYTES)) {
+        break;
+      }
+      entries.push_back(entry);
+    }
+    file.close();
+
+    segments.emplace_back(encode_segment(entries, prob_bits));
+  }
+
+  // write next to it first so a crash can't lose the table
+  std::string tmp_path = path + ".tmp"s;
+  write(tmp_path, segments, num_moving_tiles, prob_bits);
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw table_file_error("Could not replace "s + path);
+  }
+}
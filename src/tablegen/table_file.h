@@ -0,0 +1,169 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std::literals::string_literals;
+
+struct BitReader;
+
+struct TableEntry {
+  uint64_t key; // output of Board::pack_tiles
+  uint64_t probs; // output of TableGenerator::pack_probs
+
+  bool operator< (const TableEntry& other) const {
+    return key < other.key;
+  }
+};
+
+/**
+ * one <sum>.txt file of a table, memory mapped
+ *
+ * layout (all little endian):
+ *   header      magic, version, key/prob widths, # segments, # entries
+ *   directory   offset and # entries of each segment
+ *   segments    one per shard of the layer, sorted by key and cut into
+ *               blocks of BLOCK_ENTRIES, each one is
+ *     index     # blocks + 1 of first key and offset, uint64 each. the
+ *               offset is where the block starts after the index, the
+ *               extra one has where the last one ends
+ *     blocks    the bits of each block, LSB first (see bit_stream.h),
+ *               starting at a byte. 6 bits of k, then for every entry the
+ *               Rice coded key - previous key - 1 (not for the first one)
+ *               and its probs. then zeros up to a multiple of 8 bytes
+ *   8 zero bytes, so the decoder can always load a whole word
+ *
+ * probs are prob_bytes * 2 bits a direction (see TableGenerator::set_precision).
+ * a row is 0 then 0 for all zeros (a dead board), 0 then 1 for every
+ * direction at 1 (won). otherwise a 1, 7 bits of pattern, a base 3 digit
+ * per direction that's 0, 1 or something else, then the bits of every
+ * something else. the pattern gives the length, so rows before the one
+ * looked up are skipped without decoding them
+ *
+ * a lookup binary searches the block keys and decodes that one block up
+ * to the key
+ *
+ * a board is in segment bad_hash(board, # segments), that's its shard
+ * (see TableGenerator), so every thread can write the segments of its own
+ * shards without merging with the others. tables from before shards have
+ * one per thread that made them, converted tables only have one segment
+ *
+ * version 2 segments were fanout[(1 << fanout_bits) + 1] entry indices by
+ * top key bits, then key_bytes of key and prob_bytes of probs per entry.
+ * version 1 files had no directory and one segment right after the header,
+ * the old format was just the entries in hash map order, with no header
+ */
+class TableFile {
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_bits;
+    uint32_t key_bytes;
+    uint32_t prob_bytes;
+    uint32_t fanout_bits; // only used by version 1
+    uint32_t num_segments; // 0 in version 1
+    uint64_t num_entries;
+  };
+
+  struct SegmentInfo {
+    uint64_t offset;
+    uint64_t num_entries;
+    uint32_t fanout_bits; // only used by version 2
+    uint32_t reserved;
+  };
+
+  struct BlockIndex {
+    uint64_t first_key;
+    uint64_t offset;
+
+    bool operator< (uint64_t key) const {
+      return first_key < key;
+    }
+  };
+
+  struct Segment {
+    uint64_t num_entries;
+
+    // version 3
+    const BlockIndex* index;
+    const char* blocks;
+    uint64_t num_blocks;
+
+    // version 1 and 2
+    const uint64_t* fanout;
+    const char* entries;
+    uint32_t fanout_bits;
+  };
+
+  static constexpr char MAGIC[8] = {'2', '0', '4', '8', 'T', 'B', 'L', '\n'};
+  static const uint32_t VERSION = 3;
+  static const uint32_t PROB_BYTES = 7;
+  static const uint32_t BLOCK_ENTRIES = 32;
+
+  std::string path;
+
+  const char* data = nullptr;
+  std::size_t size = 0;
+
+  Header header;
+  std::vector<Segment> segments;
+  std::size_t entry_size;
+
+  int prob_bits;
+  std::array<uint8_t, 256> row_bits; // length of a row by its first 8 bits, so skipping one doesn't branch
+
+  void load_segment (uint64_t offset, uint64_t num_entries, uint32_t fanout_bits);
+  void load_block_segment (uint64_t offset, uint64_t num_entries);
+  uint64_t key_at (const Segment& segment, std::size_t i) const;
+  bool find_in_blocks (const Segment& segment, uint64_t key, uint64_t& probs) const;
+  void skip_probs (BitReader& reader) const;
+  uint64_t get_probs (BitReader& reader) const;
+public:
+  TableFile (const std::string& path);
+  ~TableFile ();
+
+  TableFile (const TableFile& other) = delete;
+  TableFile& operator=(const TableFile& other) = delete;
+
+  struct table_file_error: public std::runtime_error {
+    table_file_error(const std::string& text): std::runtime_error("Table File Error: "s + text) {}
+  };
+
+  // a segment ready to be written, see encode_segment
+  struct EncodedSegment {
+    std::vector<char> data;
+    uint64_t num_entries = 0;
+  };
+
+  // sorts entries in place, safe to call from several threads at once
+  static EncodedSegment encode_segment (std::vector<TableEntry>& entries, int prob_bits);
+  static void write (const std::string& path, const std::vector<EncodedSegment>& segments, int num_moving_tiles, int prob_bits);
+
+  // not the current version, convert_legacy rewrites it as one
+  static bool is_legacy (const std::string& path);
+  static void convert_legacy (const std::string& path, int num_moving_tiles);
+
+  std::size_t num_entries () const {
+    return header.num_entries;
+  }
+
+  int num_segments () const {
+    return segments.size();
+  }
+
+  bool find (int segment, uint64_t key, uint64_t& probs) const;
+
+  std::size_t segment_size (int segment) const {
+    return segments[segment].num_entries;
+  }
+
+  // every entry of a segment, in key order
+  void segment_entries (int segment, std::vector<TableEntry>& entries) const;
+
+  // faults every page in now instead of on the first lookups
+  void preload () const;
+};
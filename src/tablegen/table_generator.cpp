@@ -1,5 +1,16 @@
 #include <fstream>
+#include <cmath>
+#include <sstream>
+#include <iomanip>
 #include <cstdio>
+#include <cctype>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "table_generator.h"
 #include "interface.h"
@@ -11,120 +22,473 @@ void TableGenerator::thread_loop (int thread_id) {
   evaluate_all_positions(thread_id);
 }
 
-void TableGenerator::generate_all_positions (int thread_id) {
-  int saved_sum;
+void TableGenerator::barrier (int thread_id, const std::function<void()>& last_thread) {
+  telemetry->arrive(thread_id);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  int generation = barrier_generation;
+
+  completed_threads++;
+  if (completed_threads == num_threads) {
+    completed_threads = 0;
+    last_thread();
+
+    barrier_generation++;
+    cv.notify_all();
+  } else {
+    cv.wait(lock, [this, generation] {
+      return generation != barrier_generation;
+    }); // prevents "spurious wakeups"
+  }
+
+  lock.unlock();
+  telemetry->leave(thread_id);
+}
+
+std::string TableGenerator::positions_path (int sum) {
+  return positions_dir + "/"s + std::to_string(sum) + ".pos"s;
+}
+
+std::string TableGenerator::positions_dir_for (uint64_t start_tiles, uint64_t static_tiles, uint8_t goal_tile) {
+  std::ostringstream fields;
+  fields << start_tiles << " " << static_tiles << " " << static_cast<int>(goal_tile) << " " << POSITIONS_VERSION << " " << NUM_SHARDS;
+
+  // FNV-1a, it only has to be the same everywhere, std::hash isn't
+  uint64_t key = 14695981039346656037ull;
+  for (char c : fields.str()) {
+    key ^= static_cast<unsigned char>(c);
+    key *= 1099511628211ull;
+  }
+
+  std::ostringstream dir;
+  dir << "positions/" << std::hex << std::setw(16) << std::setfill('0') << key;
+  return dir.str();
+}
+
+// written to a temp file and renamed over the old one, so it's never half there
+static bool replace_file (const std::string& path, const std::string& contents) {
+  std::string tmp_path = path + ".tmp"s;
+  {
+    std::ofstream file(tmp_path);
+    file << contents;
+    if (!file.good()) {
+      std::cerr << "Could not write " << tmp_path << std::endl;
+      return false;
+    }
+  }
+
+  // fsync first, or a crash could leave an empty file behind the rename
+  int fd = open(tmp_path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
 
+bool TableGenerator::read_positions_info () {
+  std::ifstream file(positions_dir + "/info.txt"s);
+  if (!file.good()) {
+    return false;
+  }
+
+  uint64_t start = 0, tiles = 0;
+  int goal = 0, version = 0, shards = 0, top = -1;
+  std::string key;
+  while (file >> key) {
+    if (key == "start") {
+      file >> start;
+    } else if (key == "static") {
+      file >> tiles;
+    } else if (key == "goal") {
+      file >> goal;
+    } else if (key == "version") {
+      file >> version;
+    } else if (key == "shards") {
+      file >> shards;
+    } else if (key == "top_sum") {
+      file >> top;
+    }
+  }
+
+  if (start != root || tiles != static_tiles || goal != generate_goal || version != POSITIONS_VERSION || shards != NUM_SHARDS) {
+    throw table_generator_error(positions_dir + " belongs to different positions"s);
+  }
+
+  if (top < original_sum) {
+    return false; // whoever was generating them didn't finish
+  }
+  top_sum = top;
+  return true;
+}
+
+void TableGenerator::write_positions_info (bool complete) {
+  std::ostringstream info;
+  info
+    << "start " << root << std::endl
+    << "static " << static_tiles << std::endl
+    << "goal " << static_cast<int>(generate_goal) << std::endl
+    << "version " << POSITIONS_VERSION << std::endl
+    << "shards " << NUM_SHARDS << std::endl;
+  if (complete) {
+    info << "top_sum " << top_sum << std::endl;
+  }
+
+  if (!replace_file(positions_dir + "/info.txt"s, info.str())) {
+    exit(1);
+  }
+}
+
+void TableGenerator::lock_positions (bool exclusive) {
+  std::string path = positions_dir + "/lock"s;
+  positions_lock_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (positions_lock_fd < 0) {
+    throw table_generator_error("Could not open "s + path);
+  }
+
+  // only fails if someone else is generating, or evaluating while this wants to generate
+  if (flock(positions_lock_fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0) {
+    close(positions_lock_fd);
+    positions_lock_fd = -1;
+    throw table_generator_error("Another table is using "s + positions_dir + " right now"s);
+  }
+}
+
+void TableGenerator::generate_all_positions (int thread_id) {
   while (!positions_empty()) {
+    // flushed in the background while this layer and the next get expanded,
+    // even when it's kept in memory, so other tables can use it
+    for (int shard = thread_id; shard < NUM_SHARDS; shard += num_threads) {
+      position_writer->write(positions_path(tile_sum), shard, NUM_SHARDS, current_sum_positions[shard]);
+    }
+
+    // expands this thread's share of the layer, sending new boards to their owners
     get_positions(thread_id);
 
-    std::unique_lock<std::mutex> lock(mutex);
-    completed_threads++;
+    barrier(thread_id, [] {});
 
-    saved_sum = tile_sum;
-    if (completed_threads == num_threads) {
-      completed_threads = 0;
-      cache->clear();
+    // everyone's done sending, whatever is left in the inbox is the last of it
+    drain_inbox(thread_id);
 
-      std::vector<std::unique_ptr<std::ofstream>> files;
-      for (int i = 0; i < num_threads; i++) {
-        files.emplace_back(
-          std::make_unique<std::ofstream>(
-            "positions/"s + std::to_string(tile_sum) + "_"s + std::to_string(i) + ".txt"s, std::ios::binary
-          )
-        );
-      }
+    // the sum + 2 layer can't get any more boards now
+    layer_set_sizes[thread_id] = sum_plus_two_sets[thread_id].size();
+    layer_load_factors[thread_id] = sum_plus_two_sets[thread_id].load_factor();
+    sum_plus_two_sets[thread_id].clear();
+    std::swap(sum_plus_two_sets[thread_id], sum_plus_four_sets[thread_id]);
+
+    // the writer may still have the old layer, it goes back to the pool when it's done
+    for (int shard = thread_id; shard < NUM_SHARDS; shard += num_threads) {
+      current_sum_positions[shard] = std::move(sum_plus_two_positions[shard]);
+      sum_plus_two_positions[shard] = std::move(sum_plus_four_positions[shard]);
+      sum_plus_four_positions[shard] = position_writer->buffer();
+    }
 
+    barrier(thread_id, [this] {
+      uint64_t positions = 0;
+      uint64_t duplicates = 0;
+      std::vector<uint64_t> partition_positions;
+      for (int shard = 0; shard < NUM_SHARDS; shard++) {
+        positions += current_sum_positions[shard]->size();
+        partition_positions.push_back(current_sum_positions[shard]->size());
+      }
       for (int i = 0; i < num_threads; i++) {
-        for (const auto board : *current_sum_positions[i]) {
-          int hash = bad_hash(board, num_threads);
-          files[hash]->write(reinterpret_cast<const char *>(&board), sizeof board);
-        }
+        duplicates += duplicates_dropped[i];
+        duplicates_dropped[i] = 0;
       }
 
-      tile_sum += 2;
+      std::cout
+        << "Generated sum " << tile_sum + 2 << ": " << positions << " positions, "
+        << duplicates << " duplicates dropped" << std::endl;
+
+      uint64_t bytes_written = position_writer->total_bytes_written();
+      Telemetry::Record record;
+      record.add("phase", "generate").add("tile_sum", tile_sum + 2);
+      telemetry->finish_layer(record);
+      record
+        .add("positions", positions)
+        .add("partition_positions", partition_positions)
+        .add("duplicates", duplicates)
+        .add("dedup_rate", positions + duplicates == 0 ? 0.0 : static_cast<double>(duplicates) / (positions + duplicates))
+        .add("set_sizes", layer_set_sizes)
+        .add("set_load_factors", layer_load_factors)
+        .add("bytes_written", bytes_written - telemetry_bytes_written)
+        .add("in_memory", static_cast<int>(in_memory))
+        .add("memory_layers_bytes", static_cast<uint64_t>(memory_layers_bytes))
+        .add("peak_rss_kb", Telemetry::peak_rss_kb());
+      telemetry->write(record);
+      telemetry_bytes_written = bytes_written;
 
-      sum_plus_two_positions.swap(current_sum_positions);
-      sum_plus_two_positions.swap(sum_plus_four_positions);
-      for (auto &vec : sum_plus_four_positions) {
-        vec->resize(0); // why clear() it when we can save a reallocation?
+      tile_sum += 2;
+      if (in_memory) {
+        keep_layer();
       }
-
-      cv.notify_all();
-    } else {
-      cv.wait(lock, [this, saved_sum] { 
-        return saved_sum != tile_sum || positions_empty();
-      }); // prevents "spurious wakeups"
-    }
+      plan_generation();
+      write_progress("generate");
+    });
   }
 
-  std::unique_lock<std::mutex> lock(mutex);
-
-  if (!flag_done.test_and_set()) {
-    // cleanup, atomic flag means only one thread can be here
-
-    cache->destroy();
+  barrier(thread_id, [this] {
     tile_sum -= 2;
-    completed_threads = 0;
+
+    // evaluation reads the files back, so they all have to be written first
+    try {
+      position_writer->wait();
+    } catch (const std::runtime_error& ex) {
+      std::cerr << ex.what() << std::endl;
+      exit(1);
+    }
+    top_sum = tile_sum;
+    remove_positions(top_sum + 2); // the empty layer that ended it
+    write_positions_info(true);
+    write_progress("evaluate");
 
     // clean up
     for (int i = 0; i < num_threads; i++) {
-      current_sum_positions[i] = std::make_shared<std::vector<uint64_t>>();
-      sum_plus_two_positions[i] = current_sum_positions[i];
-      sum_plus_four_positions[i] = current_sum_positions[i];
+      sum_plus_two_sets[i] = ankerl::unordered_dense::set<uint64_t>();
+      sum_plus_four_sets[i] = ankerl::unordered_dense::set<uint64_t>();
     }
-  }
-  lock.unlock();
+    for (int shard = 0; shard < NUM_SHARDS; shard++) {
+      current_sum_positions[shard] = std::make_shared<std::vector<uint64_t>>();
+      sum_plus_two_positions[shard] = current_sum_positions[shard];
+      sum_plus_four_positions[shard] = current_sum_positions[shard];
+    }
+    position_writer.reset();
+  });
 }
 
 void TableGenerator::evaluate_all_positions (int thread_id) {
-  int saved_sum;
-
-  while (tile_sum >= original_sum) {
-    evaluate_positions(thread_id);
-    std::remove(("positions/"s + std::to_string(tile_sum) + "_"s + std::to_string(thread_id) + ".txt"s).c_str());
-
-    std::unique_lock<std::mutex> lock(mutex);
-    completed_threads++;
+  while (true) {
+    barrier(thread_id, [this] {
+      if (tile_sum >= original_sum) {
+        start_evaluating();
+      }
+    });
+    if (tile_sum < original_sum) {
+      break;
+    }
 
-    saved_sum = tile_sum;
+    // evaluate_passes is only set by start_evaluating, so everyone agrees on it
+    for (int pass = 0; pass < evaluate_passes; pass++) {
+      evaluate_positions();
+      barrier(thread_id, [this] {
+        next_pass();
+      });
+    }
+    finish_evaluating(thread_id);
 
-    if (completed_threads == num_threads) {
-      completed_threads = 0;
+    barrier(thread_id, [this] {
+      position_file.reset();
       write_table();
+      record_evaluation();
 
       tile_sum -= 2;
-      for (int i = 0; i < num_threads; i++) {
-        std::swap(*sum_plus_two_probs[i], *sum_plus_four_probs[i]);
-        std::swap(*current_sum_probs[i], *sum_plus_two_probs[i]);
-        current_sum_probs[i] = std::make_shared<ankerl::unordered_dense::map<uint64_t, MoveProbs>>();
+      for (int shard = 0; shard < NUM_SHARDS; shard++) {
+        sum_plus_four_probs[shard] = std::move(sum_plus_two_probs[shard]);
+        sum_plus_two_probs[shard] = std::move(current_sum_probs[shard]);
+        current_sum_probs[shard] = LayerStore();
       }
 
-      cv.notify_all();
-    } else {
-      cv.wait(lock, [this, saved_sum] { return saved_sum != tile_sum; });
+      // start_evaluating loads back whatever slices the next layer needs
+      if (lookahead_on_disk) {
+        save_lookahead(tile_sum + 2, sum_plus_two_probs);
+        for (auto& store : sum_plus_four_probs) {
+          store = LayerStore();
+        }
+        remove_lookahead(tile_sum + 6);
+        if (tile_sum < original_sum) {
+          remove_lookahead(tile_sum + 2);
+          remove_lookahead(tile_sum + 4);
+        }
+      }
+
+      // the positions only go once the table that replaces them is on record
+      write_progress(tile_sum < original_sum ? "done" : "evaluate");
+      remove_positions(tile_sum + 2);
+    });
+  }
+}
+
+void TableGenerator::record_evaluation () {
+  uint64_t lookahead_bytes = 0;
+  std::vector<uint64_t> store_sizes;
+  for (int shard = 0; shard < NUM_SHARDS; shard++) {
+    lookahead_bytes += sum_plus_two_probs[shard].bytes() + sum_plus_four_probs[shard].bytes();
+    store_sizes.push_back(current_sum_probs[shard].size());
+  }
+
+  std::error_code error;
+  uint64_t table_bytes = std::filesystem::file_size(table_dir + "/" + std::to_string(tile_sum) + ".txt", error);
+
+  Telemetry::Record record;
+  record.add("phase", "evaluate").add("tile_sum", tile_sum);
+  telemetry->finish_layer(record);
+  record
+    .add("positions", static_cast<uint64_t>(layer_sizes[tile_sum]))
+    .add("partition_positions", store_sizes)
+    .add("passes", evaluate_passes)
+    .add("largest_pass_bytes", static_cast<uint64_t>(largest_pass_bytes))
+    .add("lookahead_on_disk", static_cast<int>(lookahead_on_disk))
+    .add("lookahead_bytes", lookahead_bytes)
+    .add("table_bytes", error ? 0 : table_bytes)
+    .add("peak_rss_kb", Telemetry::peak_rss_kb());
+  telemetry->write(record);
+}
+
+void TableGenerator::plan_work (const std::vector<std::size_t>& partition_sizes, std::size_t chunk_size) {
+  work_chunks.clear();
+  for (int i = 0; i < static_cast<int>(partition_sizes.size()); i++) {
+    for (std::size_t begin = 0; begin < partition_sizes[i]; begin += chunk_size) {
+      work_chunks.push_back({i, begin, std::min(begin + chunk_size, partition_sizes[i])});
     }
   }
+  next_chunk = 0;
 }
 
-void TableGenerator::generate_table (bool positions_done) {
-  positions_generated = positions_done;
+bool TableGenerator::claim_chunk (WorkChunk& chunk) {
+  std::size_t i = next_chunk.fetch_add(1, std::memory_order_relaxed);
+  if (i >= work_chunks.size()) {
+    return false;
+  }
+  chunk = work_chunks[i];
+  return true;
+}
+
+static std::size_t physical_memory () {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGE_SIZE);
+  if (pages <= 0 || page_size <= 0) {
+    return std::size_t(8) << 30; // no idea, guess something modest
+  }
+  return static_cast<std::size_t>(pages) * page_size;
+}
+
+void TableGenerator::set_memory_budget (std::size_t bytes) {
+  memory_budget = bytes != 0 ? bytes : physical_memory() / 2;
+}
+
+void TableGenerator::add_goal (uint8_t tile, const std::string& dir) {
+  if (goals.size() == LayerStore::MAX_GOALS) {
+    throw table_generator_error("Can't evaluate more than "s + std::to_string(LayerStore::MAX_GOALS) + " goals at once"s);
+  }
+
+  if (!std::filesystem::exists(dir)) {
+    std::filesystem::create_directory(dir);
+  }
+  goals.push_back({tile, dir, board_lut.sum_of_tiles_above(root, tile)});
+
+  generate_goal = std::max(generate_goal, tile);
+  positions_dir = positions_dir_for(root, static_tiles, generate_goal);
+}
+
+void TableGenerator::generate_table () {
+  if (memory_budget == 0) {
+    set_memory_budget(0);
+  }
+
+  std::filesystem::create_directories(positions_dir);
+  positions_generated = read_positions_info();
+  lock_positions(!positions_generated);
+
+  if (!positions_generated) {
+    std::cout << "Generating positions in " << positions_dir << std::endl;
+    write_positions_info(false);
+    position_writer = std::make_unique<PositionWriter>(std::min(num_threads, 4), pack_mask);
+
+    // the other half goes to the dedup sets and the lookahead stores
+    in_memory = expected_layer_size * sizeof(uint64_t) < memory_budget / 32;
+  } else {
+    std::cout << "Using the positions already in " << positions_dir << std::endl;
+    tile_sum = top_sum;
+  }
+
+  setup_layers();
+  if (!positions_generated) {
+    if (in_memory) {
+      keep_layer();
+    }
+    plan_generation();
+  }
+  run_threads();
+}
+
+void TableGenerator::resume_table (const Progress& progress) {
+  if (progress.phase != "evaluate") {
+    throw table_generator_error("Only a table that stopped while evaluating can be resumed"s);
+  }
+
+  if (progress.shards != NUM_SHARDS) {
+    throw table_generator_error("The positions were made by an older version, make the table again"s);
+  }
+
+  if (!read_positions_info()) {
+    throw table_generator_error("The positions in "s + positions_dir + " aren't all there any more"s);
+  }
+  lock_positions(false);
+
+  positions_generated = true;
+  if (memory_budget == 0) {
+    set_memory_budget(0);
+  }
+  top_sum = progress.top_sum;
+  tile_sum = progress.tile_sum;
+
+  // runs from the run that died, the lookahead comes from the table files instead
+  for (const auto& entry : std::filesystem::directory_iterator(table_dir)) {
+    if (entry.path().filename().string().rfind("lookahead_", 0) == 0) {
+      std::filesystem::remove(entry.path());
+    }
+  }
+
+  setup_layers();
+  load_lookahead(tile_sum + 2, sum_plus_two_probs);
+  load_lookahead(tile_sum + 4, sum_plus_four_probs);
+
+  std::cout << "Resuming at sum " << tile_sum << std::endl;
+  run_threads();
+}
+
+void TableGenerator::setup_layers () {
+  progress_reporter = std::make_unique<ProgressReporter>(table_dir + "/status.json"s, PROGRESS_INTERVAL);
+
+  for (int shard = 0; shard < NUM_SHARDS; shard++) {
+    if (position_writer) {
+      current_sum_positions.emplace_back(position_writer->buffer());
+      sum_plus_two_positions.emplace_back(position_writer->buffer());
+      sum_plus_four_positions.emplace_back(position_writer->buffer());
+    } else {
+      current_sum_positions.emplace_back(std::make_shared<std::vector<uint64_t>>());
+      sum_plus_two_positions.emplace_back(std::make_shared<std::vector<uint64_t>>());
+      sum_plus_four_positions.emplace_back(std::make_shared<std::vector<uint64_t>>());
+    }
+
+    current_sum_probs.emplace_back();
+    sum_plus_two_probs.emplace_back();
+    sum_plus_four_probs.emplace_back();
+  }
 
   for (int i = 0; i < num_threads; i++) {
-    current_sum_positions.emplace_back(std::make_shared<std::vector<uint64_t>>());
-    sum_plus_two_positions.emplace_back(std::make_shared<std::vector<uint64_t>>());
-    sum_plus_four_positions.emplace_back(std::make_shared<std::vector<uint64_t>>());
-
-    current_sum_probs.emplace_back(
-      std::make_shared<ankerl::unordered_dense::map<uint64_t, MoveProbs>>()
-    );
-    sum_plus_two_probs.emplace_back(
-      std::make_shared<ankerl::unordered_dense::map<uint64_t, MoveProbs>>()
-    );
-    sum_plus_four_probs.emplace_back(
-      std::make_shared<ankerl::unordered_dense::map<uint64_t, MoveProbs>>()
-    );
-  }
-  current_sum_positions[0]->emplace_back(root);
+    sum_plus_two_outbox.emplace_back(num_threads);
+    sum_plus_four_outbox.emplace_back(num_threads);
+    inboxes.emplace_back(std::make_unique<Inbox>());
+    sum_plus_two_sets.emplace_back();
+    sum_plus_four_sets.emplace_back();
+    if (!positions_generated) {
+      sum_plus_two_sets.back().reserve(expected_layer_size / num_threads);
+      sum_plus_four_sets.back().reserve(expected_layer_size / num_threads);
+    }
+    duplicates_dropped.emplace_back(0);
+  }
+  current_sum_positions[shard_of(root)]->emplace_back(root);
+  table_segments.assign(goals.size(), std::vector<TableFile::EncodedSegment>(NUM_SHARDS));
+  layer_entries.assign(goals.size(), std::vector<std::vector<TableEntry>>(NUM_SHARDS));
+  layer_best.resize(NUM_SHARDS);
+  layer_partials.resize(NUM_SHARDS);
+  layer_set_sizes.resize(num_threads);
+  layer_load_factors.resize(num_threads);
+}
+
+void TableGenerator::run_threads () {
+  telemetry = std::make_unique<Telemetry>(table_dir + "/telemetry.jsonl"s, num_threads);
 
   for (int i = 0; i < num_threads; i++) {
     threads.emplace_back(std::thread(&TableGenerator::thread_loop, this, i));
@@ -133,70 +497,179 @@ void TableGenerator::generate_table (bool positions_done) {
   for (auto& thread : threads) {
     thread.join();
   }
+  threads.clear();
+  progress_reporter.reset();
+
+  // done with the positions, someone else can generate them again
+  close(positions_lock_fd);
+  positions_lock_fd = -1;
 }
 
-void TableGenerator::get_positions (int thread_id) {
-  std::size_t total_size = 0;
-  for (const auto& vec : current_sum_positions) {
-    total_size += vec->size();
+void TableGenerator::load_lookahead (int sum, std::vector<LayerStore>& layer) {
+  if (sum > top_sum) {
+    return;
   }
 
-  std::size_t partition_size;
-  std::size_t before_size;
-  if (thread_id < (total_size % num_threads)) {
-    partition_size = total_size / num_threads + 1;
-    before_size = (total_size / num_threads + 1) * thread_id;
-  } else {
-    partition_size = total_size / num_threads;
-    before_size = (total_size / num_threads + 1) * (total_size % num_threads) + (total_size / num_threads) * (thread_id - (total_size % num_threads));
+  // the highest goal's table has every board, the lower ones have the same segments but only their games
+  std::vector<std::unique_ptr<TableFile>> goal_files(goals.size());
+  std::size_t all_boards = 0;
+  for (std::size_t goal = 0; goal < goals.size(); goal++) {
+    std::string path = goals[goal].table_dir + "/" + std::to_string(sum) + ".txt";
+    if (goals[goal].tile == generate_goal) {
+      all_boards = goal;
+    } else if (!std::filesystem::exists(path)) {
+      continue;
+    }
+
+    try {
+      goal_files[goal] = std::make_unique<TableFile>(path);
+    } catch (const TableFile::table_file_error& ex) {
+      throw table_generator_error(ex.what());
+    }
   }
 
-  std::shared_ptr<std::vector<uint64_t>> start_vec = nullptr;
-  std::size_t start_vec_idx = 0;
+  std::vector<std::vector<LayerStore::Entry>> shards(NUM_SHARDS);
+  std::vector<TableEntry> entries;
+  const TableFile& table_file = *goal_files[all_boards];
+  for (int segment = 0; segment < table_file.num_segments(); segment++) {
+    table_file.segment_entries(segment, entries);
+
+    for (const TableEntry& table_entry : entries) {
+      uint64_t board = board_lut.unpack_tiles(table_entry.key, pack_mask) | static_tiles;
+
+      LayerStore::Entry entry = {table_entry.key, {}};
+      for (std::size_t goal = 0; goal < goals.size(); goal++) {
+        uint64_t probs = table_entry.probs;
+        if (goal == all_boards || (goal_files[goal] && goal_files[goal]->find(segment, table_entry.key, probs))) {
+          std::array<float, 4> unpacked = unpack_probs(probs);
+          entry.best[goal] = LayerStore::quantize(*std::max_element(unpacked.begin(), unpacked.end()));
+        } else if (board_lut.num_tiles(board, goals[goal].tile) > 1 && !board_lut.game_over(board)) {
+          entry.best[goal] = LayerStore::quantize(1); // won, left out
+        }
+        // otherwise it's past the end of that goal's game, nothing in it gets here
+      }
 
-  std::size_t sum = 0;
-  std::vector<uint64_t>::iterator start_it;
+      shards[shard_of(board)].push_back(entry);
+    }
+  }
 
-  for (const auto& vec : current_sum_positions) {
-    sum += vec->size();
-    if (sum > before_size) {
-      start_vec = vec;
-      start_it = vec->begin() + (before_size - (sum - vec->size()));
+  for (int shard = 0; shard < NUM_SHARDS; shard++) {
+    layer[shard] = LayerStore(shards[shard], num_moving_tiles, goals.size());
+  }
+  layer_sizes[sum] = table_file.num_entries();
+}
 
-      break;
+void TableGenerator::write_progress (const std::string& phase) {
+  std::ostringstream file;
+  file << "phase " << phase << std::endl;
+  if (phase == "generate") {
+    file << "tile_sum " << tile_sum << std::endl;
+  } else if (phase != "done") {
+    file << "tile_sum " << tile_sum << std::endl;
+    file << "top_sum " << top_sum << std::endl;
+    file << "shards " << NUM_SHARDS << std::endl;
+    file << "positions " << positions_dir << std::endl;
+    file << "tables " << tile_sum + 2 << " " << top_sum << std::endl;
+    file << "lookahead " << tile_sum + 2 << " " << tile_sum + 4 << std::endl;
+    for (std::size_t goal = 1; goal < goals.size(); goal++) {
+      file << "goal " << static_cast<int>(goals[goal].tile) << " " << goals[goal].table_dir << std::endl;
     }
-    start_vec_idx++;
+  } else {
+    file << "tables " << original_sum << " " << top_sum << std::endl;
   }
 
-  sum = 0;
-  std::shared_ptr<std::vector<uint64_t>> vec = start_vec;
-  int vec_idx = start_vec_idx;
+  replace_file(table_dir + "/progress.txt"s, file.str());
+}
 
-  while (true) {
-    if (start_vec == nullptr) {
-      break;
-    }
+bool TableGenerator::read_progress (const std::string& table_dir, Progress& progress) {
+  std::ifstream file(table_dir + "/progress.txt"s);
+  if (!file.good()) {
+    return false;
+  }
 
-    if (sum > 0) {
-      start_it = vec->begin();
+  std::string key;
+  while (file >> key) {
+    if (key == "phase") {
+      file >> progress.phase;
+    } else if (key == "tile_sum") {
+      file >> progress.tile_sum;
+    } else if (key == "top_sum") {
+      file >> progress.top_sum;
+    } else if (key == "shards") {
+      file >> progress.shards;
+    } else if (key == "goal") {
+      std::pair<int, std::string> goal;
+      file >> goal.first >> goal.second;
+      progress.extra_goals.push_back(goal);
+    } else {
+      // ranges are just there for people reading it
+      std::string rest;
+      std::getline(file, rest);
     }
+  }
 
-    std::vector<uint64_t>::iterator end_it;
+  return !progress.phase.empty();
+}
 
-    if (sum + std::distance(start_it, vec->end()) > partition_size) {
-      end_it = start_it + (partition_size - sum);
-    } else {
-      end_it = vec->end();
+void TableGenerator::remove_positions (int sum) {
+  // the files stay, the next table with these positions starts from them
+  auto it = memory_layers.find(sum);
+  if (it != memory_layers.end()) {
+    for (const auto& positions : it->second) {
+      memory_layers_bytes -= positions->size() * sizeof(uint64_t);
     }
+    memory_layers.erase(it);
+  }
+}
 
-    for (auto it = start_it; it != end_it; it++) {
-      uint64_t board = *it;
+void TableGenerator::keep_layer () {
+  // layers only ever shrink from here on, so the slack from growing is wasted
+  for (const auto& positions : current_sum_positions) {
+    positions->shrink_to_fit();
+    memory_layers_bytes += positions->size() * sizeof(uint64_t);
+  }
+  memory_layers[tile_sum] = current_sum_positions;
+
+  if (memory_layers_bytes > memory_budget / 2) {
+    spill_layers();
+  }
+}
+
+void TableGenerator::spill_layers () {
+  std::cout << "The positions don't fit in memory any more, reading them from " << positions_dir << " instead" << std::endl;
+
+  // they're all written or queued already, the writer holds on to them until they're done
+  memory_layers.clear();
+  memory_layers_bytes = 0;
+  in_memory = false;
+}
+
+void TableGenerator::plan_generation () {
+  std::vector<std::size_t> partition_sizes;
+  uint64_t layer_size = 0;
+  for (const auto& positions : current_sum_positions) {
+    partition_sizes.push_back(positions->size());
+    layer_size += positions->size();
+  }
+  plan_work(partition_sizes, GENERATE_CHUNK);
+  progress_reporter->start_layer("generate", tile_sum, layer_size, 0);
+}
+
+void TableGenerator::get_positions (int thread_id) {
+  WorkChunk chunk;
+  while (claim_chunk(chunk)) {
+    // keeps inboxes from piling up while everyone's still expanding
+    drain_inbox(thread_id);
+
+    const std::vector<uint64_t>& positions = *current_sum_positions[chunk.partition];
+    for (std::size_t i = chunk.begin; i < chunk.end; i++) {
+      uint64_t board = positions[i];
 
       if (board_lut.game_over(board)) {
         continue;
       }
 
-      if (board_lut.num_tiles(board, goal_tile) > 1) {
+      if (board_lut.num_tiles(board, generate_goal) > 1) {
         continue;
       }
 
@@ -206,12 +679,60 @@ void TableGenerator::get_positions (int thread_id) {
       test_direction(thread_id, board, Direction::left);
     }
 
-    sum += std::distance(start_it, end_it);
-    if (sum < partition_size) {
-      vec = current_sum_positions[vec_idx + 1];
-      vec_idx++;
-    } else {
-      break;
+    progress_reporter->add(chunk.end - chunk.begin);
+  }
+
+  for (int owner = 0; owner < num_threads; owner++) {
+    send_outbox(thread_id, owner);
+  }
+}
+
+void TableGenerator::send_outbox (int thread_id, int owner) {
+  auto& plus_two = sum_plus_two_outbox[thread_id][owner];
+  auto& plus_four = sum_plus_four_outbox[thread_id][owner];
+  if (plus_two.empty() && plus_four.empty()) {
+    return;
+  }
+
+  Inbox& inbox = *inboxes[owner];
+  std::lock_guard<std::mutex> lock(inbox.mutex);
+  if (!plus_two.empty()) {
+    inbox.sum_plus_two.emplace_back(std::move(plus_two));
+    plus_two = std::vector<uint64_t>();
+  }
+  if (!plus_four.empty()) {
+    inbox.sum_plus_four.emplace_back(std::move(plus_four));
+    plus_four = std::vector<uint64_t>();
+  }
+}
+
+void TableGenerator::drain_inbox (int thread_id) {
+  std::vector<std::vector<uint64_t>> plus_two;
+  std::vector<std::vector<uint64_t>> plus_four;
+  {
+    Inbox& inbox = *inboxes[thread_id];
+    std::lock_guard<std::mutex> lock(inbox.mutex);
+    plus_two.swap(inbox.sum_plus_two);
+    plus_four.swap(inbox.sum_plus_four);
+  }
+
+  // only this thread touches its own sets and layers, so no locking here
+  for (const auto& batch : plus_two) {
+    for (const uint64_t board : batch) {
+      if (sum_plus_two_sets[thread_id].insert(board).second) {
+        sum_plus_two_positions[shard_of(board)]->emplace_back(board);
+      } else {
+        duplicates_dropped[thread_id]++;
+      }
+    }
+  }
+  for (const auto& batch : plus_four) {
+    for (const uint64_t board : batch) {
+      if (sum_plus_four_sets[thread_id].insert(board).second) {
+        sum_plus_four_positions[shard_of(board)]->emplace_back(board);
+      } else {
+        duplicates_dropped[thread_id]++;
+      }
     }
   }
 }
@@ -240,13 +761,20 @@ void TableGenerator::test_direction (int thread_id, uint64_t board, Direction di
 
     empty_squares >>= trailing;
     i -= trailing;
+
+    // the owner of a board is the thread that dedups it and evaluates it later
     uint64_t new_board = board_lut.set_tile(moved_board, 3 - i % 4, i / 4, 1);
-    if (!cache->test(new_board)) {
-      sum_plus_two_positions[thread_id]->emplace_back(new_board);
+    int owner = owner_of(shard_of(new_board));
+    sum_plus_two_outbox[thread_id][owner].emplace_back(new_board);
+    if (sum_plus_two_outbox[thread_id][owner].size() >= EXCHANGE_BATCH) {
+      send_outbox(thread_id, owner);
     }
+
     new_board = board_lut.set_tile(moved_board, 3 - i % 4, i / 4, 2);
-    if (!cache->test(new_board)) {
-      sum_plus_four_positions[thread_id]->emplace_back(new_board);
+    owner = owner_of(shard_of(new_board));
+    sum_plus_four_outbox[thread_id][owner].emplace_back(new_board);
+    if (sum_plus_four_outbox[thread_id][owner].size() >= EXCHANGE_BATCH) {
+      send_outbox(thread_id, owner);
     }
 
     empty_squares >>= 1;
@@ -254,52 +782,371 @@ void TableGenerator::test_direction (int thread_id, uint64_t board, Direction di
   }
 }
 
-void TableGenerator::evaluate_positions (int thread_id) {
-  std::ifstream positions_file("positions/"s + std::to_string(tile_sum) + "_"s + std::to_string(thread_id) + ".txt"s, std::ios::binary);
+void TableGenerator::start_evaluating () {
+  if (!in_memory) {
+    try {
+      position_file = std::make_unique<PositionFile>(positions_path(tile_sum));
+    } catch (const std::runtime_error& ex) {
+      std::cerr << ex.what() << std::endl;
+      exit(1);
+    }
+  }
+
+  std::vector<std::size_t> partition_sizes;
+  for (int i = 0; i < NUM_SHARDS; i++) {
+    if (in_memory) {
+      std::size_t size = memory_layers[tile_sum][i]->size();
+      partition_sizes.push_back(size);
+      for (auto& entries : layer_entries) {
+        entries[i].resize(size);
+      }
+      layer_best[i].resize(size);
+      continue;
+    }
 
-  uint64_t board;
-  while (positions_file.good()) {
-    positions_file.read(reinterpret_cast<char *>(&board), sizeof board);
+    std::size_t size = position_file->segment_size(i);
+    partition_sizes.push_back(size);
+    for (auto& entries : layer_entries) {
+      entries[i].resize(size);
+    }
+    layer_best[i].resize(size);
+  }
+
+  plan_work(partition_sizes, EVALUATE_CHUNK);
+  plan_passes(partition_sizes);
 
-    MoveProbs move_probs;
-    if (board_lut.game_over(board)) {
-      move_probs.probs = {0, 0, 0, 0};
-    } else if (board_lut.num_tiles(board, goal_tile) > 1) {
-      move_probs.probs = {1, 1, 1, 1};
+  uint64_t layer_size = 0;
+  for (std::size_t size : partition_sizes) {
+    layer_size += size;
+  }
+  uint64_t boards_below = 0;
+  for (int sum = original_sum; sum < tile_sum; sum += 2) {
+    boards_below += positions_in_layer(sum);
+  }
+  progress_reporter->start_layer("evaluate", tile_sum, layer_size * evaluate_passes, boards_below);
+}
+
+uint64_t TableGenerator::positions_in_layer (int sum) {
+  auto counted = positions_counts.find(sum);
+  if (counted != positions_counts.end()) {
+    return counted->second;
+  }
+
+  uint64_t positions = 0;
+  if (in_memory) {
+    auto it = memory_layers.find(sum);
+    if (it != memory_layers.end()) {
+      for (const auto& partition : it->second) {
+        positions += partition->size();
+      }
+    }
+    return positions;
+  }
+
+  try {
+    positions = PositionFile(positions_path(sum)).size();
+  } catch (const std::runtime_error& ex) {
+    // it's only for the ETA
+  }
+  positions_counts[sum] = positions;
+  return positions;
+}
+
+void TableGenerator::plan_passes (const std::vector<std::size_t>& partition_sizes) {
+  std::size_t layer_size = 0;
+  for (std::size_t size : partition_sizes) {
+    layer_size += size;
+  }
+
+  std::size_t lookahead_boards = 0;
+  for (int sum : {tile_sum + 2, tile_sum + 4}) {
+    auto it = layer_sizes.find(sum);
+    if (it != layer_sizes.end()) {
+      lookahead_boards += it->second;
+    }
+  }
+
+  // a board of this layer has a table entry and an encoded entry per goal, and a lookahead entry
+  std::size_t lookahead_bytes = lookahead_boards * (sizeof(uint64_t) + sizeof(uint16_t) * goals.size());
+  std::size_t layer_bytes = layer_size * (sizeof(TableEntry) * 2 * goals.size() + sizeof(LayerStore::Entry));
+  std::size_t used = memory_layers_bytes + layer_bytes;
+  std::size_t available = memory_budget > used ? memory_budget - used : 0;
+
+  evaluate_passes = 1;
+  current_pass = 0;
+  pass_slices = {0, LayerStore::NUM_SLICES};
+  largest_pass_bytes = lookahead_bytes;
+  if (lookahead_on_disk || lookahead_bytes > available) {
+    if (!lookahead_on_disk) {
+      std::cout << "The lookahead doesn't fit in memory any more, evaluating in passes" << std::endl;
+      save_lookahead(tile_sum + 2, sum_plus_two_probs);
+      save_lookahead(tile_sum + 4, sum_plus_four_probs);
+      lookahead_on_disk = true;
+    }
+
+    if (lookahead_bytes > available) {
+      // partial sums have to live between passes too
+      std::size_t partial_bytes = layer_size * goals.size() * sizeof(std::array<float, 4>);
+      available = available > partial_bytes ? available - partial_bytes : 0;
+      available = std::max(available, memory_budget / 16);
+      plan_pass_slices(available);
+    }
+
+    if (evaluate_passes > 1) {
+      for (int i = 0; i < NUM_SHARDS; i++) {
+        layer_partials[i].assign(partition_sizes[i] * goals.size(), {0, 0, 0, 0});
+      }
+    }
+    load_pass();
+  }
+}
+
+void TableGenerator::plan_pass_slices (std::size_t available) {
+  // what each slice of the saved runs takes once loaded, the fanout is about a byte a key
+  std::size_t key_bytes = sizeof(uint64_t) + sizeof(uint16_t) * goals.size() + 1;
+  std::vector<std::size_t> slice_bytes(LayerStore::NUM_SLICES, 0);
+  try {
+    for (int sum : {tile_sum + 2, tile_sum + 4}) {
+      if (sum > top_sum) {
+        continue;
+      }
+      for (int i = 0; i < NUM_SHARDS; i++) {
+        std::vector<uint64_t> sizes = LayerStore::slice_sizes(lookahead_path(sum, i));
+        for (int slice = 0; slice < LayerStore::NUM_SLICES; slice++) {
+          slice_bytes[slice] += sizes[slice] * key_bytes;
+        }
+      }
+    }
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    exit(1);
+  }
+
+  // as many slices as fit in each pass, in order
+  pass_slices = {0};
+  largest_pass_bytes = 0;
+  std::size_t pass_bytes = 0;
+  for (int slice = 0; slice < LayerStore::NUM_SLICES; slice++) {
+    if (pass_bytes > 0 && pass_bytes + slice_bytes[slice] > available) {
+      pass_slices.push_back(slice);
+      pass_bytes = 0;
+    }
+    pass_bytes += slice_bytes[slice];
+    largest_pass_bytes = std::max(largest_pass_bytes, pass_bytes);
+  }
+  pass_slices.push_back(LayerStore::NUM_SLICES);
+  evaluate_passes = pass_slices.size() - 1;
+
+  // a slice can't be split, so one that's too big on its own goes over
+  if (largest_pass_bytes > available) {
+    std::cerr
+      << "The biggest lookahead pass of sum " << tile_sum << " needs " << largest_pass_bytes / 1000000 << " MB, over the "
+      << available / 1000000 << " MB the memory budget leaves for it" << std::endl;
+  }
+}
+
+void TableGenerator::next_pass () {
+  current_pass++;
+  if (current_pass < evaluate_passes) {
+    load_pass();
+    next_chunk = 0;
+  }
+}
+
+void TableGenerator::load_pass () {
+  pass_first_slice = pass_slices[current_pass];
+  pass_last_slice = pass_slices[current_pass + 1];
+
+  try {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+      sum_plus_two_probs[i] = LayerStore();
+      sum_plus_four_probs[i] = LayerStore();
+      if (tile_sum + 2 <= top_sum) {
+        sum_plus_two_probs[i] = LayerStore::load(lookahead_path(tile_sum + 2, i), pass_first_slice, pass_last_slice, num_moving_tiles, goals.size());
+      }
+      if (tile_sum + 4 <= top_sum) {
+        sum_plus_four_probs[i] = LayerStore::load(lookahead_path(tile_sum + 4, i), pass_first_slice, pass_last_slice, num_moving_tiles, goals.size());
+      }
+    }
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    exit(1);
+  }
+}
+
+std::string TableGenerator::lookahead_path (int sum, int shard) {
+  // it's this table's probabilities, so it doesn't go with the shared positions
+  return table_dir + "/lookahead_"s + std::to_string(sum) + "_"s + std::to_string(shard) + ".bin"s;
+}
+
+void TableGenerator::save_lookahead (int sum, std::vector<LayerStore>& layer) {
+  if (sum > top_sum) {
+    return;
+  }
+
+  try {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+      layer[i].save(lookahead_path(sum, i));
+      layer[i] = LayerStore();
+    }
+  } catch (const std::runtime_error& ex) {
+    std::cerr << ex.what() << std::endl;
+    exit(1);
+  }
+}
+
+void TableGenerator::remove_lookahead (int sum) {
+  for (int i = 0; i < NUM_SHARDS; i++) {
+    std::remove(lookahead_path(sum, i).c_str());
+  }
+}
+
+void TableGenerator::evaluate_positions () {
+  std::vector<uint64_t> boards(EVALUATE_CHUNK);
+  std::vector<char> buffer;
+  std::vector<LookaheadProbe> probes;
+  std::array<bool, EVALUATE_BATCH> game_overs;
+  std::array<std::array<float, LayerStore::MAX_GOALS>, EVALUATE_BATCH * 4> direction_probs;
+
+  WorkChunk chunk;
+  while (claim_chunk(chunk)) {
+    const uint64_t* chunk_boards;
+    if (in_memory) {
+      chunk_boards = memory_layers[tile_sum][chunk.partition]->data() + chunk.begin;
     } else {
-      move_probs.probs[0] = evaluate_direction(board, Direction::up, thread_id);
-      move_probs.probs[1] = evaluate_direction(board, Direction::right, thread_id);
-      move_probs.probs[2] = evaluate_direction(board, Direction::down, thread_id);
-      move_probs.probs[3] = evaluate_direction(board, Direction::left, thread_id);
+      try {
+        position_file->read_block(chunk.partition, chunk.begin / PositionFile::BLOCK_SIZE, buffer, boards.data());
+      } catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << std::endl;
+        exit(1);
+      }
+      for (std::size_t i = 0; i < chunk.end - chunk.begin; i++) {
+        boards[i] = board_lut.unpack_tiles(boards[i], pack_mask) | static_tiles;
+      }
+      chunk_boards = boards.data();
     }
 
-    move_probs.find_best_move();
-    (*current_sum_probs[thread_id])[board] = move_probs;
+    int num_goals = goals.size();
+    for (std::size_t batch = chunk.begin; batch < chunk.end; batch += EVALUATE_BATCH) {
+      std::size_t batch_end = std::min(batch + EVALUATE_BATCH, chunk.end);
+
+      // the moves and children are the same for every goal, only the lookups differ
+      probes.clear();
+      for (std::size_t i = batch; i < batch_end; i++) {
+        uint64_t board = chunk_boards[i - chunk.begin];
+        game_overs[i - batch] = board_lut.game_over(board);
+        bool any_playing = false;
+        for (const Goal& goal : goals) {
+          any_playing |= !game_overs[i - batch] && board_lut.num_tiles(board, goal.tile) <= 1;
+        }
+
+        if (any_playing) {
+          int target = (i - batch) * 4;
+          probe_direction(board, Direction::up, target, probes);
+          probe_direction(board, Direction::right, target + 1, probes);
+          probe_direction(board, Direction::down, target + 2, probes);
+          probe_direction(board, Direction::left, target + 3, probes);
+        }
+      }
+
+      direction_probs.fill({});
+      resolve_probes(probes, direction_probs.data());
+
+      for (std::size_t i = batch; i < batch_end; i++) {
+        uint64_t board = chunk_boards[i - chunk.begin];
+        bool game_over = game_overs[i - batch];
+
+        uint64_t key = board_lut.pack_tiles(board, pack_mask);
+        LayerStore::Entry best = {key, {}};
+
+        for (int goal = 0; goal < num_goals; goal++) {
+          MoveProbs move_probs;
+          if (game_over) {
+            move_probs.probs = {0, 0, 0, 0};
+          } else if (board_lut.num_tiles(board, goals[goal].tile) > 1) {
+            move_probs.probs = {1, 1, 1, 1};
+          } else {
+            for (int dir = 0; dir < 4; dir++) {
+              move_probs.probs[dir] = direction_probs[(i - batch) * 4 + dir][goal];
+            }
+
+            // each pass only sees some of the lookahead, they add up to the whole thing
+            if (evaluate_passes > 1) {
+              std::array<float, 4>& partial = layer_partials[chunk.partition][i * num_goals + goal];
+              for (int dir = 0; dir < 4; dir++) {
+                partial[dir] += move_probs.probs[dir];
+              }
+              move_probs.probs = partial;
+            }
+          }
+
+          if (current_pass + 1 < evaluate_passes) {
+            continue;
+          }
+
+          move_probs.find_best_move();
+
+          // chunks don't overlap, so nobody else writes these
+          layer_entries[goal][chunk.partition][i] = {key, pack_probs(move_probs.probs)};
+          best.best[goal] = LayerStore::quantize(move_probs.probs[move_probs.best_move]);
+        }
+
+        if (current_pass + 1 == evaluate_passes) {
+          layer_best[chunk.partition][i] = best;
+        }
+      }
+    }
+
+    progress_reporter->add(chunk.end - chunk.begin);
+  }
+}
+
+void TableGenerator::finish_evaluating (int thread_id) {
+  for (int shard = thread_id; shard < NUM_SHARDS; shard += num_threads) {
+    // this thread's segments of the tables, the barrier just writes them all out
+    for (std::size_t goal = 0; goal < goals.size(); goal++) {
+      std::vector<TableEntry>& entries = layer_entries[goal][shard];
+      entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const TableEntry& entry) {
+        return !in_goal_game(board_lut.unpack_tiles(entry.key, pack_mask) | static_tiles, goals[goal]);
+      }), entries.end());
+
+      table_segments[goal][shard] = TableFile::encode_segment(entries, prob_bits());
+      layer_entries[goal][shard] = std::vector<TableEntry>();
+    }
+    current_sum_probs[shard] = LayerStore(layer_best[shard], num_moving_tiles, goals.size());
+
+    layer_best[shard] = std::vector<LayerStore::Entry>();
+    layer_partials[shard] = std::vector<std::array<float, 4>>();
   }
 }
 
-MoveProbs TableGenerator::lookup_probs (
-  std::vector<std::shared_ptr<ankerl::unordered_dense::map<uint64_t, MoveProbs>>> probs,
-  uint64_t board
-) {
-  return (*probs[bad_hash(board, num_threads)])[board];
+void TableGenerator::add_probe (const std::vector<LayerStore>& layer, uint64_t board, double chance, int target, std::vector<LookaheadProbe>& probes) {
+  uint64_t key = board_lut.pack_tiles(board, pack_mask);
+
+  // another pass has it, no point searching
+  if (evaluate_passes > 1) {
+    int slice = LayerStore::slice_of(key, num_moving_tiles);
+    if (slice < pass_first_slice || slice >= pass_last_slice) {
+      return;
+    }
+  }
+
+  probes.push_back({&layer[shard_of(board)], key, chance, target});
 }
 
-float TableGenerator::evaluate_direction (uint64_t board, Direction dir, int thread_id) {
+void TableGenerator::probe_direction (uint64_t board, Direction dir, int target, std::vector<LookaheadProbe>& probes) {
   uint64_t moved_board = board_lut.move(board, dir);
   if (moved_board == board) {
-    return 0;
+    return;
   }
 
   if ((moved_board & static_tiles_mask) != static_tiles) {
-    return 0;
+    return;
   }
 
   uint16_t empty_squares = board_lut.get_empty_squares(moved_board);
   int num_empty = __builtin_popcount(empty_squares);
 
-  float prob = 0;
-
   int i = 15;
   while (empty_squares) {
     int trailing = __builtin_ctz(empty_squares); // intrinsic, trailing zeroes
@@ -308,56 +1155,285 @@ float TableGenerator::evaluate_direction (uint64_t board, Direction dir, int thr
     i -= trailing;
     uint64_t new_board = board_lut.set_tile(moved_board, 3 - i % 4, i / 4, 1);
 
-    MoveProbs lookup = lookup_probs(sum_plus_two_probs, new_board);
-    prob += lookup.probs[lookup.best_move] * 0.9 / num_empty;
+    add_probe(sum_plus_two_probs, new_board, 0.9 / num_empty, target, probes);
 
     new_board = board_lut.set_tile(moved_board, 3 - i % 4, i / 4, 2);
-    lookup = lookup_probs(sum_plus_four_probs, new_board);
-    prob += lookup.probs[lookup.best_move] * 0.1 / num_empty;
+    add_probe(sum_plus_four_probs, new_board, 0.1 / num_empty, target, probes);
 
     empty_squares >>= 1;
     i--;
   }
+}
+
+void TableGenerator::resolve_probes (const std::vector<LookaheadProbe>& probes, std::array<float, LayerStore::MAX_GOALS>* direction_probs) {
+  // by the time a loop gets back to the first probe, its prefetch from the loop before has landed
+  for (const auto& probe : probes) {
+    probe.store->prefetch_bucket(probe.key);
+  }
+  for (const auto& probe : probes) {
+    probe.store->prefetch_keys(probe.key);
+  }
+
+  int num_goals = goals.size();
+  for (const auto& probe : probes) {
+    // boards that aren't in the layer are worth 0
+    const uint16_t* best = probe.store->find(probe.key);
+    if (best == nullptr) {
+      continue;
+    }
 
-  return prob;
+    for (int goal = 0; goal < num_goals; goal++) {
+      direction_probs[probe.target][goal] += best[goal] / 65535.0f * probe.chance;
+    }
+  }
 }
 
 void TableGenerator::write_table () {
-  std::ofstream table_file(table_dir + "/" + std::to_string(tile_sum) + ".txt", std::ios::binary);
+  // the highest goal has every board, the lower ones only their own games
+  std::size_t boards = 0;
+  for (std::size_t goal = 0; goal < goals.size(); goal++) {
+    std::size_t goal_boards = 0;
+    for (auto& segment : table_segments[goal]) {
+      goal_boards += segment.num_entries;
+    }
+    boards = std::max(boards, goal_boards);
 
-  for (int i = 0; i < num_threads; i++) {
-    for (const auto it : *current_sum_probs[i]) {
-      uint64_t packed_board = board_lut.pack_tiles(it.first, moving_tiles_map);
-      table_file.write(reinterpret_cast<char *>(&packed_board), (num_moving_tiles / 2) + (num_moving_tiles % 2 != 0));
-      uint64_t packed_probs = pack_probs(it.second.probs);
-      table_file.write(reinterpret_cast<char *>(&packed_probs), 7);
+    // past where a lower goal's game ends, its table stops too
+    if (goal_boards != 0) {
+      TableFile::write(goals[goal].table_dir + "/" + std::to_string(tile_sum) + ".txt", table_segments[goal], num_moving_tiles, prob_bits());
+    }
+    for (auto& segment : table_segments[goal]) {
+      segment = TableFile::EncodedSegment();
     }
   }
+  layer_sizes[tile_sum] = boards;
 }
 
-MoveProbs TableGenerator::read_table (uint64_t board) {
-  int sum = board_lut.sum_of_tiles(board);
-  std::ifstream table_file(table_dir + "/" + std::to_string(sum) + ".txt", std::ios::binary);
-  if (!table_file.good()) {
+TableFile& TableGenerator::get_table_file (int sum) {
+  {
+    std::shared_lock<std::shared_mutex> lock(table_files_mutex);
+    auto it = table_files.find(sum);
+    if (it != table_files.end()) {
+      return *it->second;
+    }
+  }
+
+  std::unique_lock<std::shared_mutex> lock(table_files_mutex);
+  auto it = table_files.find(sum);
+  if (it != table_files.end()) {
+    return *it->second;
+  }
+
+  std::string path = table_dir + "/" + std::to_string(sum) + ".txt";
+  if (!std::filesystem::exists(path)) {
     throw table_lookup_error("Table file doesn't exist for sum "s + std::to_string(sum));
   }
 
-  while (table_file.good()) {
-    uint64_t packed_board = 0;
-    table_file.read(reinterpret_cast<char *>(&packed_board), (num_moving_tiles / 2) + (num_moving_tiles % 2 != 0));
-    if (packed_board != board_lut.pack_tiles(board, moving_tiles_map)) {
-      table_file.ignore(7);
-      continue;
+  try {
+    it = table_files.emplace(sum, std::make_unique<TableFile>(path)).first;
+  } catch (const TableFile::table_file_error& ex) {
+    throw table_lookup_error(ex.what());
+  }
+  return *it->second;
+}
+
+void TableGenerator::set_precision (int bits) {
+  if (!valid_precision(bits)) {
+    throw table_generator_error("Probabilities can have 8, 12, 14 or 16 bits, not "s + std::to_string(bits));
+  }
+  precision = bits;
+}
+
+uint64_t TableGenerator::pack_probs (const std::array<float, 4>& probs) {
+  if (precision == LEGACY_PRECISION) {
+    uint64_t res = 0;
+    for (int i = 0; i < 4; i++) {
+      float prob = probs[i];
+      if (tile_sum == 32768) {
+        // makes 1 not end up as 0.99999, at the cost of 1/2^14 becoming 0
+        prob -= 1.0 / (1 << 14);
+      }
+      // what taking off each binary digit in turn came to
+      int64_t part = std::clamp<int64_t>(std::floor(prob * (1 << 14)), 0, 0x3FFF);
+      res |= static_cast<uint64_t>(part) << (14 * i);
     }
+    return res;
+  }
 
-    uint64_t packed_probs = 0;
-    table_file.read(reinterpret_cast<char *>(&packed_probs), 7);
+  int bits = precision;
+  float steps = (1 << bits) - 1;
+
+#if defined(__SSE2__)
+  // all 4 at once, rounding to nearest is the default mode of cvtps
+  __m128 scaled = _mm_mul_ps(_mm_loadu_ps(probs.data()), _mm_set1_ps(steps));
+  scaled = _mm_min_ps(_mm_max_ps(scaled, _mm_setzero_ps()), _mm_set1_ps(steps));
+  __m128i parts = _mm_cvtps_epi32(scaled);
+
+  // directions 0 and 2 in the low halves, 1 and 3 shifted up next to them
+  __m128i even = _mm_and_si128(parts, _mm_set_epi32(0, -1, 0, -1));
+  __m128i odd = _mm_srli_epi64(parts, 32);
+  __m128i pairs = _mm_or_si128(even, _mm_sll_epi64(odd, _mm_cvtsi32_si128(bits)));
+
+  uint64_t low = _mm_cvtsi128_si64(pairs);
+  uint64_t high = _mm_cvtsi128_si64(_mm_unpackhi_epi64(pairs, pairs));
+  return low | (high << (2 * bits));
+#else
+  uint64_t res = 0;
+  for (int i = 0; i < 4; i++) {
+    float scaled = std::clamp(probs[i] * steps, 0.0f, steps);
+    res |= static_cast<uint64_t>(std::nearbyint(scaled)) << (bits * i);
+  }
+  return res;
+#endif
+}
 
-    MoveProbs move_probs;
-    move_probs.probs = unpack_probs(packed_probs);
+std::array<float, 4> TableGenerator::unpack_probs (uint64_t packed) {
+  std::array<float, 4> probs;
+
+  if (precision == LEGACY_PRECISION) {
+    for (int i = 0; i < 4; i++) {
+      uint64_t part = (packed >> (14 * i)) & 0x3FFF;
+      // the sum of the digits, and one step more on anything that isn't 0
+      probs[i] = (part + (part != 0)) * (1.0f / (1 << 14));
+    }
+    return probs;
+  }
+
+  int bits = precision;
+  uint64_t mask = (UINT64_C(1) << bits) - 1;
+
+#if defined(__SSE2__)
+  // directions 0 and 1 in the low half, 2 and 3 in the high one, then split them into 32 bit lanes
+  __m128i halves = _mm_set_epi64x(packed >> (2 * bits), packed);
+  __m128i lane_mask = _mm_set1_epi64x(mask);
+  __m128i even = _mm_and_si128(halves, lane_mask);
+  __m128i odd = _mm_and_si128(_mm_srl_epi64(halves, _mm_cvtsi32_si128(bits)), lane_mask);
+  __m128i parts = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+
+  // a division so the top step comes back as exactly 1
+  _mm_storeu_ps(probs.data(), _mm_div_ps(_mm_cvtepi32_ps(parts), _mm_set1_ps(mask)));
+#else
+  for (int i = 0; i < 4; i++) {
+    probs[i] = static_cast<float>((packed >> (bits * i)) & mask) / mask;
+  }
+#endif
+
+  return probs;
+}
+
+MoveProbs TableGenerator::read_table (uint64_t board) {
+  MoveProbs move_probs;
+
+  // a lower goal's table leaves out the boards it won, and the layers with only those
+  // that's 1 everywhere, unless no move is left, the same as evaluating them gives
+  bool won = board_lut.num_tiles(board, goal_tile) > 1;
+  float won_prob = board_lut.game_over(board) ? 0 : 1;
+  int sum = board_lut.sum_of_tiles(board);
+  if (won && !std::filesystem::exists(table_dir + "/" + std::to_string(sum) + ".txt")) {
+    move_probs.probs = {won_prob, won_prob, won_prob, won_prob};
     move_probs.find_best_move();
     return move_probs;
   }
 
-  throw table_lookup_error("Could not find probabilities for board "s + Interface::board_to_hash(board, board_lut));
+  TableFile& table_file = get_table_file(sum);
+
+  // generated tables have a segment per shard, older ones one per thread that made them
+  int segment = table_file.num_segments() == 1 ? 0 : bad_hash(board, table_file.num_segments());
+
+  uint64_t packed_probs;
+  if (table_file.find(segment, board_lut.pack_tiles(board, pack_mask), packed_probs)) {
+    move_probs.probs = unpack_probs(packed_probs);
+  } else if (won) {
+    move_probs.probs = {won_prob, won_prob, won_prob, won_prob};
+  } else {
+    throw table_lookup_error("Could not find probabilities for board "s + Interface::board_to_hash(board, board_lut));
+  }
+
+  move_probs.find_best_move();
+  return move_probs;
+}
+
+std::vector<int> TableGenerator::table_sums () {
+  std::vector<int> sums;
+  for (const auto& entry : std::filesystem::directory_iterator(table_dir)) {
+    std::string stem = entry.path().stem().string();
+    if (entry.path().extension() != ".txt" || stem.empty() || !std::all_of(stem.begin(), stem.end(), ::isdigit)) {
+      continue;
+    }
+    sums.push_back(std::stoi(stem));
+  }
+
+  std::sort(sums.begin(), sums.end());
+  return sums;
+}
+
+void TableGenerator::load_all_tables () {
+  for (int sum : table_sums()) {
+    get_table_file(sum).preload();
+  }
+}
+
+std::string TableGenerator::export_policy () {
+  std::vector<PolicyFile::EncodedLayer> layers;
+  std::vector<TableEntry> entries;
+  std::vector<uint64_t> keys;
+  std::vector<uint8_t> moves;
+
+  for (int sum : table_sums()) {
+    TableFile& table_file = get_table_file(sum);
+    keys.clear();
+    moves.clear();
+
+    for (int segment = 0; segment < table_file.num_segments(); segment++) {
+      table_file.segment_entries(segment, entries);
+      for (const auto& entry : entries) {
+        MoveProbs move_probs;
+        move_probs.probs = unpack_probs(entry.probs);
+        move_probs.find_best_move();
+        keys.push_back(entry.key);
+        moves.push_back(move_probs.best_move);
+      }
+    }
+
+    layers.push_back(PolicyFile::encode_layer(sum, keys, moves));
+  }
+
+  // written next to it first, a server could have the old one mapped
+  std::string path = table_dir + "/policy.bin";
+  std::string tmp_path = path + ".tmp";
+  PolicyFile::write(tmp_path, layers);
+  std::filesystem::rename(tmp_path, path);
+  return path;
+}
+
+void TableGenerator::load_policy () {
+  policy_file = std::make_unique<PolicyFile>(table_dir + "/policy.bin");
+  policy_file->preload();
+}
+
+uint8_t TableGenerator::read_policy (uint64_t board) {
+  if (!policy_file) {
+    throw table_lookup_error("No policy loaded");
+  }
+
+  uint8_t move;
+  if (!policy_file->find(board_lut.sum_of_tiles(board), board_lut.pack_tiles(board, pack_mask), move)) {
+    throw table_lookup_error("The policy has no boards with the tile sum of "s + Interface::board_to_hash(board, board_lut));
+  }
+  return move;
+}
+
+void TableGenerator::convert_table () {
+  for (int sum : table_sums()) {
+    std::string path = table_dir + "/" + std::to_string(sum) + ".txt";
+    if (!TableFile::is_legacy(path)) {
+      continue;
+    }
+
+    std::cout << "Converting " << path << std::endl;
+    TableFile::convert_legacy(path, num_moving_tiles);
+  }
+
+  std::unique_lock<std::shared_mutex> lock(table_files_mutex);
+  table_files.clear();
 }
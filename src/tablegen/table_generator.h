@@ -5,14 +5,22 @@
 #include <thread>
 #include <cstdint>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
 #include <algorithm>
 #include <atomic>
 #include <functional>
 #include <filesystem>
+#include <map>
 
 #include "board.h"
-#include "cache.h"
+#include "table_file.h"
+#include "position_writer.h"
+#include "position_file.h"
+#include "policy_file.h"
+#include "layer_store.h"
+#include "telemetry.h"
+#include "progress_reporter.h"
 
 #include "ankerl/unordered_dense.h"
 
@@ -40,12 +48,33 @@ private:
   std::string table_dir;
   bool positions_generated;
 
+  /**
+   * positions live in positions/<key>/, where the key is a hash of the
+   * start board, static tiles, goal and POSITIONS_VERSION, so any other
+   * table with the same ones evaluates them without generating again.
+   * they're kept after evaluating for that reason. info.txt says what
+   * they're for and gets a top_sum once every layer is written, and
+   * whoever is generating holds an exclusive flock on lock, evaluating
+   * holds a shared one
+   *
+   * every layer is split into NUM_SHARDS by bad_hash(board, NUM_SHARDS),
+   * no matter how many threads there are. thread t owns the shards with
+   * shard % num_threads == t, the lookahead stores and table segments are
+   * per shard too. a layer is <sum>.pos, a PositionFile with a segment per
+   * shard, so a table's positions are a file a layer however many shards
+   * there are. nothing deletes them, delete the directory to get the space
+   * back and the next table that needs them generates them again
+   */
+  static const int POSITIONS_VERSION = 3; // one file a layer
+  std::string positions_dir;
+  int positions_lock_fd = -1;
+
   int num_threads;
   std::vector<std::thread> threads;
   std::mutex mutex;
   std::condition_variable cv;
-  std::atomic_flag flag_done = ATOMIC_FLAG_INIT;
   int completed_threads = 0;
+  int barrier_generation = 0;
 
   Board& board_lut;
 
@@ -53,23 +82,168 @@ private:
 
   uint64_t static_tiles;
   uint64_t static_tiles_mask = 0;
-  uint64_t moving_tiles_map;
+  uint64_t pack_mask;
   int num_moving_tiles;
 
   uint8_t goal_tile;
+  std::size_t expected_layer_size; // where the dedup sets start, 0 when only reading
+
+  /**
+   * every goal being evaluated. goals[0] is goal_tile, the one this table
+   * is for and the one read_table answers, add_goal adds more that get
+   * evaluated in the same pass and written to their own table directory
+   *
+   * positions are generated once, for the highest goal. that covers the
+   * lower ones, since making two of the highest means making two of every
+   * goal below it on the way, where the lower goals stop anyway
+   *
+   * a lower goal's game is only the boards before that, so its table only
+   * gets those (see in_goal_game), and layers with none aren't written.
+   * boards it already won are left out as well, read_table knows them
+   */
+  struct Goal {
+    uint8_t tile;
+    std::string table_dir;
+    int root_above; // sum_of_tiles_above of the start board
+  };
+  std::vector<Goal> goals;
+  uint8_t generate_goal;
 
   std::vector<std::shared_ptr<std::vector<uint64_t>>> current_sum_positions;
   int original_sum;
   int tile_sum;
+  int top_sum = 0; // highest layer with positions, known once generating is done
 
   std::vector<std::shared_ptr<std::vector<uint64_t>>> sum_plus_two_positions;
   std::vector<std::shared_ptr<std::vector<uint64_t>>> sum_plus_four_positions;
 
-  std::unique_ptr<Cache> cache;
+  /**
+   * every board has an owner thread, the owner of its shard. threads
+   * expand their own part of the layer and batch up new boards per owner
+   * in the outboxes ([sender][owner]), full batches go to the owner's
+   * inbox. only the owner dedups its boards and writes them out, so the
+   * sets don't need any locking
+   */
+  static const std::size_t EXCHANGE_BATCH = 4096;
+
+  struct Inbox {
+    std::mutex mutex;
+    std::vector<std::vector<uint64_t>> sum_plus_two;
+    std::vector<std::vector<uint64_t>> sum_plus_four;
+  };
+
+  std::vector<std::vector<std::vector<uint64_t>>> sum_plus_two_outbox;
+  std::vector<std::vector<std::vector<uint64_t>>> sum_plus_four_outbox;
+  std::vector<std::unique_ptr<Inbox>> inboxes;
+
+  std::vector<ankerl::unordered_dense::set<uint64_t>> sum_plus_two_sets;
+  std::vector<ankerl::unordered_dense::set<uint64_t>> sum_plus_four_sets;
+  std::vector<uint64_t> duplicates_dropped;
+
+  /**
+   * small tables keep every layer in memory as well as writing it to
+   * positions/, evaluating reads them straight from here. it starts out in
+   * memory unless one expected layer is already a big part of the budget,
+   * and if the layers outgrow it they're dropped and it carries on from
+   * disk like before
+   */
+  bool in_memory = false;
+  std::map<int, std::vector<std::shared_ptr<std::vector<uint64_t>>>> memory_layers;
+  std::size_t memory_layers_bytes = 0;
+  std::size_t memory_budget = 0; // see set_memory_budget
+
+  int precision = DEFAULT_PRECISION;
+
+  // live progress on stderr and in <table>/status.json, only exists while running
+  static constexpr double PROGRESS_INTERVAL = 5.0;
+  std::unique_ptr<ProgressReporter> progress_reporter;
+
+  // per layer records in <table>/telemetry.jsonl, made when the threads start
+  std::unique_ptr<Telemetry> telemetry;
+  std::vector<uint64_t> layer_set_sizes;
+  std::vector<double> layer_load_factors;
+  uint64_t telemetry_bytes_written = 0;
+
+  // only exists while generating
+  std::unique_ptr<PositionWriter> position_writer;
+
+  /**
+   * boards near game over or the goal are a lot cheaper than the rest, so
+   * instead of every thread doing its own partition, the partitions of a
+   * layer are cut into chunks and threads keep grabbing the next one until
+   * they're gone. expanded boards still go to their owner's inbox, and
+   * evaluated ones land at their index in their shard
+   */
+  static const std::size_t GENERATE_CHUNK = 4096;
+  static const std::size_t EVALUATE_CHUNK = PositionFile::BLOCK_SIZE; // a chunk is one block of the file
+
+  /**
+   * evaluating a board is looking up every spawn after every move in the
+   * sum + 2 and sum + 4 stores, ~50 lookups that each miss the cache. so
+   * evaluate_positions takes EVALUATE_BATCH boards at a time, gathers all
+   * their lookups as probes first, and resolves them together with the
+   * prefetches of LayerStore in between
+   */
+  static const std::size_t EVALUATE_BATCH = 4;
+
+  struct LookaheadProbe {
+    const LayerStore* store;
+    uint64_t key;
+    double chance;
+    int target; // what it adds to, board in the batch * 4 + direction
+  };
+
+  struct WorkChunk {
+    int partition;
+    std::size_t begin;
+    std::size_t end;
+  };
 
-  std::vector<std::shared_ptr<ankerl::unordered_dense::map<uint64_t, MoveProbs>>> current_sum_probs;
-  std::vector<std::shared_ptr<ankerl::unordered_dense::map<uint64_t, MoveProbs>>> sum_plus_two_probs;
-  std::vector<std::shared_ptr<ankerl::unordered_dense::map<uint64_t, MoveProbs>>> sum_plus_four_probs;
+  std::vector<WorkChunk> work_chunks;
+  std::atomic<std::size_t> next_chunk{0};
+
+  // the layer being evaluated, a segment per shard, and layer_entries by goal first
+  std::unique_ptr<PositionFile> position_file;
+  std::vector<std::vector<std::vector<TableEntry>>> layer_entries;
+  std::vector<std::vector<LayerStore::Entry>> layer_best;
+
+  /**
+   * out of core evaluating: once the lookahead doesn't fit in the memory
+   * budget, every evaluated layer gets saved as sorted runs in the table
+   * directory (see LayerStore), and a layer is evaluated in passes over slices of
+   * the key space. a pass only loads its slices of the sum + 2 and sum + 4
+   * runs, and adds up what those children are worth in layer_partials,
+   * the last pass turns the sums into table entries. with several goals
+   * a board's partials are at [i * goals.size() + goal]
+   *
+   * passes take as many slices as fit in the budget, going by the slice
+   * sizes in the runs. slices are even shares of the scrambled keys, so
+   * only a budget smaller than one slice (1/256 of the lookahead) goes over
+   */
+  bool lookahead_on_disk = false;
+  int evaluate_passes = 1;
+  int current_pass = 0;
+  int pass_first_slice = 0;
+  int pass_last_slice = LayerStore::NUM_SLICES;
+  std::vector<int> pass_slices; // pass i loads slices [pass_slices[i], pass_slices[i + 1])
+  std::size_t largest_pass_bytes = 0;
+  std::vector<std::vector<std::array<float, 4>>> layer_partials;
+  std::map<int, std::size_t> layer_sizes; // # boards of every evaluated layer
+  std::map<int, uint64_t> positions_counts; // positions_in_layer, so headers get read once
+
+  // lookahead for evaluating, one store per shard of the layer
+  std::vector<LayerStore> current_sum_probs;
+  std::vector<LayerStore> sum_plus_two_probs;
+  std::vector<LayerStore> sum_plus_four_probs;
+
+  // each thread encodes the shards it owns, the barrier only writes them out, by goal then shard
+  std::vector<std::vector<TableFile::EncodedSegment>> table_segments;
+
+  // mapped once per sum and kept around, reopening per lookup was the slow part
+  std::map<int, std::unique_ptr<TableFile>> table_files;
+  std::shared_mutex table_files_mutex;
+
+  std::unique_ptr<PolicyFile> policy_file; // from load_policy
 
   bool positions_empty () {
     return std::all_of(
@@ -81,52 +255,6 @@ private:
     );
   }
 
-  uint64_t pack_probs (const std::array<float, 4>& probs) {
-    // 14 digit binary decimals, 7 bytes total
-    uint64_t res = 0;
-
-    for (int i = 0; i < 4; i++) {
-      float prob = probs[i];
-      if (tile_sum == 32768)
-      /**
-       * simple trick that makes 1 not end up as 0.99999, this shifts 
-       * everything left by one digit but you lose one piece of data where
-       * the value 1/2^14 is just 0
-       */
-      prob -= 1.0 / (1 << 14);
-      for (int exp = 1; exp <= 14; exp++) {
-        if (prob >= 1.0 / (1 << exp)) {
-          res |= ((UINT64_C(1) << (14 - exp)) << (14 * i));
-          prob -= 1.0 / (1 << exp);
-        }
-      }
-    }
-
-    return res;
-  }
-
-  std::array<float, 4> unpack_probs (uint64_t packed) {
-    std::array<float, 4> probs;
-    
-    for (int i = 0; i < 4; i++) {
-      uint64_t part = (packed >> (14 * i)) & 0x3FFF; // 0b11 1111 1111 1111
-      probs[i] = 0.0;
-
-      for (int exp = 1; exp <= 14; exp++) {
-        if (((part >> (14 - exp)) & 1) == 1) {
-          probs[i] += 1.0 / (1 << exp);
-        }
-      }
-
-      if (probs[i] != 0) {
-        probs[i] += 1.0 / (1 << 14);
-      }
-    }
-
-    return probs;
-  }
-
-
   int bad_hash (uint64_t x, int modulus) {
     x ^= (x << 21);
     x ^= (x >> 35);
@@ -134,38 +262,105 @@ private:
     return x % modulus;
   }
 
+  int shard_of (uint64_t board) {
+    return bad_hash(board, NUM_SHARDS);
+  }
+
+  // getting past a lower goal means merging two of it, so the tiles above it stay the start board's
+  bool in_goal_game (uint64_t board, const Goal& goal) {
+    return goal.tile == generate_goal || (board_lut.sum_of_tiles_above(board, goal.tile) == goal.root_above && board_lut.num_tiles(board, goal.tile) <= 1);
+  }
+
+  int owner_of (int shard) {
+    return shard % num_threads;
+  }
+
+  std::string positions_path (int sum);
+  bool read_positions_info ();
+  void write_positions_info (bool complete);
+  void lock_positions (bool exclusive);
+
   void generate_all_positions (int thread_id);
   void evaluate_all_positions (int thread_id);
 
+  // waits for every thread, the last one to get here runs last_thread first
+  void barrier (int thread_id, const std::function<void()>& last_thread);
+
+  void plan_work (const std::vector<std::size_t>& partition_sizes, std::size_t chunk_size);
+  void plan_generation ();
+  bool claim_chunk (WorkChunk& chunk);
+
   void get_positions (int thread_id);
   void test_direction (int thread_id, uint64_t board, Direction dir);
-
-  void evaluate_positions (int thread_id);
-  float evaluate_direction (uint64_t board, Direction dir, int thread_id);
-  MoveProbs lookup_probs (
-    std::vector<std::shared_ptr<ankerl::unordered_dense::map<uint64_t, MoveProbs>>> probs,
-    uint64_t board
-  );
+  void send_outbox (int thread_id, int owner);
+  void drain_inbox (int thread_id);
+
+  void setup_layers ();
+  void run_threads ();
+  void load_lookahead (int sum, std::vector<LayerStore>& layer);
+  void write_progress (const std::string& phase);
+  void remove_positions (int sum);
+  void keep_layer ();
+  void spill_layers ();
+
+  void start_evaluating ();
+  uint64_t positions_in_layer (int sum);
+  void plan_passes (const std::vector<std::size_t>& partition_sizes);
+  void plan_pass_slices (std::size_t available);
+  void next_pass ();
+  void load_pass ();
+  std::string lookahead_path (int sum, int shard);
+  void save_lookahead (int sum, std::vector<LayerStore>& layer);
+  void remove_lookahead (int sum);
+  void evaluate_positions ();
+  void finish_evaluating (int thread_id);
+  void probe_direction (uint64_t board, Direction dir, int target, std::vector<LookaheadProbe>& probes);
+  void add_probe (const std::vector<LayerStore>& layer, uint64_t board, double chance, int target, std::vector<LookaheadProbe>& probes);
+  void resolve_probes (const std::vector<LookaheadProbe>& probes, std::array<float, LayerStore::MAX_GOALS>* direction_probs);
   void write_table ();
+  void record_evaluation ();
+  TableFile& get_table_file (int sum);
+  std::vector<int> table_sums ();
 public:
-  TableGenerator (Board& board_lut, const std::string& name, uint64_t start_tiles, uint64_t static_tiles, uint8_t goal_tile, std::size_t cache_size, int num_threads): board_lut(board_lut), table_dir(name), root(start_tiles), static_tiles(static_tiles), goal_tile(goal_tile), num_threads(num_threads) {
-    if (!std::filesystem::exists("positions")) {
-      std::filesystem::create_directory("positions");
-    }
+  TableGenerator (Board& board_lut, const std::string& name, uint64_t start_tiles, uint64_t static_tiles, uint8_t goal_tile, std::size_t expected_layer_size, int num_threads): table_dir(name), num_threads(num_threads), board_lut(board_lut), root(start_tiles), static_tiles(static_tiles), goal_tile(goal_tile), expected_layer_size(expected_layer_size) {
     if (!std::filesystem::exists(table_dir)) {
       std::filesystem::create_directory(table_dir);
     }
 
     static_tiles_mask = board_lut.make_static_tiles_mask(static_tiles);
-    moving_tiles_map = board_lut.make_moving_tiles_map(static_tiles);
+    pack_mask = board_lut.make_pack_mask(static_tiles);
     num_moving_tiles = __builtin_popcount(board_lut.get_empty_squares(static_tiles));
 
-    cache = std::make_unique<Cache>(cache_size);
-
     original_sum = board_lut.sum_of_tiles(root);
     tile_sum = original_sum;
+    goals.push_back({goal_tile, table_dir, board_lut.sum_of_tiles_above(start_tiles, goal_tile)});
+    generate_goal = goal_tile;
+    positions_dir = positions_dir_for(root, static_tiles, generate_goal);
+  }
+
+  /**
+   * bits a direction in pack_probs, see set_precision. tables from before
+   * meta.txt had a precision are LEGACY_PRECISION, 14 bit binary fractions
+   * rounded down, plus one 1/2^14 step when they come back (not on 0)
+   */
+  static const int DEFAULT_PRECISION = 14;
+  static const int LEGACY_PRECISION = 0;
+
+  static bool valid_precision (int bits) {
+    return bits == 8 || bits == 12 || bits == 14 || bits == 16 || bits == LEGACY_PRECISION;
+  }
+
+  // before generating or reading anything
+  void set_precision (int bits);
+
+  int prob_bits () const {
+    return precision == LEGACY_PRECISION ? 14 : precision;
   }
 
+  // direction i is bits [i * prob_bits, (i + 1) * prob_bits), round(prob * (2^bits - 1))
+  uint64_t pack_probs (const std::array<float, 4>& probs);
+  std::array<float, 4> unpack_probs (uint64_t packed);
+
   struct table_generator_error: public std::runtime_error {
     table_generator_error(const std::string& text): std::runtime_error("Table Generator Error: "s + text) {}
   };
@@ -174,8 +369,60 @@ public:
     table_lookup_error(const std::string& text): std::runtime_error("Table Lookup Error: "s + text) {}
   };
 
+  // shards a layer is split into, see positions_dir. the planner's estimates use it too
+  static const int NUM_SHARDS = 61; // prime, bad_hash's low bits alone don't spread boards out
+
+  /**
+   * <table>/progress.txt, rewritten (to a temp file, then renamed over the
+   * old one) after every layer, so a run that dies can be picked up again
+   *
+   *   phase      generate, evaluate or done
+   *   tile_sum   the next layer to expand or evaluate
+   *   top_sum    the highest layer, every positions file up to it is written
+   *   shards     # shards per layer, always NUM_SHARDS
+   *   positions  the directory they're in
+   *   tables     the range of layers that already have table files
+   *   lookahead  the table files evaluating tile_sum needs
+   *   goal       a goal from add_goal and its table directory, one line each
+   *
+   * generating keeps its next layers in memory, so a run that died while
+   * generating starts over. evaluate is only written once the position
+   * writer is done, so even a run that had its layers in memory can be
+   * resumed from the files. one that died evaluating reloads the
+   * lookahead from the table files and carries on with tile_sum
+   */
+  struct Progress {
+    std::string phase;
+    int tile_sum = 0;
+    int top_sum = 0;
+    int shards = 0;
+    std::vector<std::pair<int, std::string>> extra_goals; // tile, table directory
+  };
+
+  static bool read_progress (const std::string& table_dir, Progress& progress);
+
+  // where the positions for these go, see positions_dir
+  static std::string positions_dir_for (uint64_t start_tiles, uint64_t static_tiles, uint8_t goal_tile);
+
+  // everything generating and evaluating may use, 0 is half the machine's memory
+  void set_memory_budget (std::size_t bytes);
+
+  // another goal to evaluate along with this one, its tables go in table_dir
+  void add_goal (uint8_t goal_tile, const std::string& table_dir);
+
   void thread_loop (int thread_id);
-  void generate_table (bool positions_generated);
+  // skips generating if another table already made the same positions
+  void generate_table ();
+  void resume_table (const Progress& progress);
 
+  // safe to call from several threads at once
   MoveProbs read_table (uint64_t board);
+  void load_all_tables ();
+  void convert_table ();
+
+  // writes <table>/policy.bin with the best move of every board, see PolicyFile
+  std::string export_policy ();
+  void load_policy ();
+  // only for boards in the table, others get a meaningless move. safe to call from several threads at once after load_policy
+  uint8_t read_policy (uint64_t board);
 };
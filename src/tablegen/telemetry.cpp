@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <iomanip>
+#include <sys/resource.h>
+
+#include "telemetry.h"
+
+void Telemetry::Record::key (const std::string& name) {
+  out << (empty ? "{" : ", ") << "\"" << name << "\": ";
+  empty = false;
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, const std::string& value) {
+  key(name);
+  out << "\"" << value << "\"";
+  return *this;
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, const char* value) {
+  return add(name, std::string(value));
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, double value) {
+  key(name);
+  out << std::setprecision(6) << value;
+  return *this;
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, int value) {
+  key(name);
+  out << value;
+  return *this;
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, uint64_t value) {
+  key(name);
+  out << value;
+  return *this;
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, const std::vector<double>& values) {
+  key(name);
+  out << "[";
+  for (std::size_t i = 0; i < values.size(); i++) {
+    out << (i == 0 ? "" : ", ") << std::setprecision(6) << values[i];
+  }
+  out << "]";
+  return *this;
+}
+
+Telemetry::Record& Telemetry::Record::add (const std::string& name, const std::vector<uint64_t>& values) {
+  key(name);
+  out << "[";
+  for (std::size_t i = 0; i < values.size(); i++) {
+    out << (i == 0 ? "" : ", ") << values[i];
+  }
+  out << "]";
+  return *this;
+}
+
+std::string Telemetry::Record::str () const {
+  return empty ? "{}" : out.str() + "}";
+}
+
+Telemetry::Telemetry (const std::string& path, int num_threads): file(path, std::ios::app), layer_start(clock::now()), arrived(num_threads, layer_start), waited(num_threads, 0) {}
+
+void Telemetry::arrive (int thread_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  arrived[thread_id] = clock::now();
+}
+
+void Telemetry::leave (int thread_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // finish_layer already counted the part of this wait before it
+  clock::time_point since = std::max(arrived[thread_id], layer_start);
+  waited[thread_id] += std::chrono::duration<double>(clock::now() - since).count();
+}
+
+void Telemetry::finish_layer (Record& record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  clock::time_point now = clock::now();
+  double layer_seconds = std::chrono::duration<double>(now - layer_start).count();
+
+  std::vector<double> working;
+  std::vector<double> waiting;
+  for (std::size_t i = 0; i < waited.size(); i++) {
+    // everyone's sitting in this barrier right now, that's waiting too
+    double wait = waited[i];
+    if (arrived[i] > layer_start) {
+      wait += std::chrono::duration<double>(now - arrived[i]).count();
+    }
+    waiting.push_back(wait);
+    working.push_back(std::max(0.0, layer_seconds - wait));
+    waited[i] = 0;
+  }
+  layer_start = now;
+
+  record.add("seconds", layer_seconds);
+  record.add("thread_seconds", working);
+  record.add("barrier_wait_seconds", waiting);
+}
+
+void Telemetry::write (const Record& record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  file << record.str() << std::endl;
+}
+
+uint64_t Telemetry::peak_rss_kb () {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_maxrss; // already KB on linux
+}
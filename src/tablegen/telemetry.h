@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <mutex>
+#include <cstdint>
+
+/**
+ * per layer records of a table run, one JSON object a line in
+ * <table>/telemetry.jsonl, so a long run can be looked at afterwards
+ *
+ * the generator tells it when each thread gets to a barrier and leaves
+ * it, and finish_layer() works out how long every thread spent working
+ * and waiting since the last record. the rest of the record is whatever
+ * counts the generator adds to it
+ */
+class Telemetry {
+private:
+  using clock = std::chrono::steady_clock;
+
+  std::ofstream file;
+  std::mutex mutex;
+
+  clock::time_point layer_start;
+  std::vector<clock::time_point> arrived;
+  std::vector<double> waited;
+public:
+  // a JSON object being built up, keys in the order they're added
+  class Record {
+  private:
+    std::ostringstream out;
+    bool empty = true;
+
+    void key (const std::string& name);
+  public:
+    Record& add (const std::string& name, const std::string& value);
+    Record& add (const std::string& name, const char* value);
+    Record& add (const std::string& name, double value);
+    Record& add (const std::string& name, int value);
+    Record& add (const std::string& name, uint64_t value);
+    Record& add (const std::string& name, const std::vector<double>& values);
+    Record& add (const std::string& name, const std::vector<uint64_t>& values);
+
+    std::string str () const;
+  };
+
+  Telemetry (const std::string& path, int num_threads);
+
+  // both called by every thread at every barrier
+  void arrive (int thread_id);
+  void leave (int thread_id);
+
+  // call from the last thread at a barrier, adds the layer's timings and resets them
+  void finish_layer (Record& record);
+
+  void write (const Record& record);
+
+  static uint64_t peak_rss_kb ();
+};